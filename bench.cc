@@ -0,0 +1,540 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <getopt.h>
+
+#include "frame.h"
+#include "energy.h"
+#include "diff.h"
+#include "edmondskarp.h"
+#include "costmodel.h"
+#include "storage.h"
+
+using namespace std;
+
+static const size_t default_warmup = 3;
+static const size_t default_repetitions = 15;
+// a kernel regresses when its median is this much slower than baseline
+static const double default_threshold = 0.10;
+// and the difference is this many median absolute deviations
+static const double significance = 3.0;
+// timed solves per cost model sample
+static const size_t model_repetitions = 3;
+// seams carved per timed run of the cap sweep
+static const size_t sweep_seams = 8;
+
+// Fixed inputs, made once so every run sees the same data
+static Frame<RgbPixel>* color = NULL;
+static Frame<PixelValue>* grey = NULL;
+static FrameWrapper greyWrapper(false);
+static string ppm;
+static string pgm;
+static Frame<PixelValue>* smallEnergy = NULL;
+static Frame<RgbPixel>* smallColor = NULL;
+// cut in place, so every run starts from a fresh copy of smallColor
+static Frame<RgbPixel> cutSubject;
+static EdmondsKarpFlowState* state = NULL;
+
+/* Deterministic test image: smooth gradients and hard edges, with some
+   noise so that the flow has to work around it. */
+static void makeInputs() {
+  const size_t w = 640, h = 480;
+  color = new Frame<RgbPixel>(w, h);
+  grey = new Frame<PixelValue>(w, h);
+  unsigned int seed = 12345;
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      seed = seed * 1103515245 + 12345;
+      PixelValue noise = (seed >> 16) & 0x1f;
+      RgbPixel& p = color->values[x + y * w];
+      p.r = (x * 255 / w + noise) & 0xff;
+      p.g = (y * 255 / h + noise) & 0xff;
+      p.b = (((x / 40) + (y / 30)) % 2) ? 0xe0 : 0x20;
+      grey->values[x + y * w] = (p.r + p.g + p.b) / 3;
+    }
+  }
+  greyWrapper.greyFrame = *grey;
+
+  ostringstream os;
+  printPnm(*color, os, true);
+  ppm = os.str();
+  os.str("");
+  printPnm(*grey, os, true);
+  pgm = os.str();
+
+  // the solver kernels get a quarter of the image each way
+  const size_t sw = w / 4, sh = h / 4;
+  smallColor = new Frame<RgbPixel>(sw, sh);
+  for (size_t y = 0; y < sh; y++) {
+    for (size_t x = 0; x < sw; x++) {
+      smallColor->values[x + y * sw] = color->values[x + y * w];
+    }
+  }
+  smallEnergy = getDifferential(*smallColor);
+}
+
+static void parsePpm() {
+  istringstream is(ppm);
+  FrameWrapper frame;
+  loadPnm(is, frame);
+}
+
+static void parsePgm() {
+  istringstream is(pgm);
+  FrameWrapper frame;
+  loadPnm(is, frame);
+}
+
+// both of the above and the differential of each, in one pass
+static void parseDifferentialPpm() {
+  istringstream is(ppm);
+  FrameWrapper frame;
+  Frame<PixelValue> energy;
+  loadPnmDifferential(is, frame, energy);
+}
+
+static void parseDifferentialPgm() {
+  istringstream is(pgm);
+  FrameWrapper frame;
+  Frame<PixelValue> energy;
+  loadPnmDifferential(is, frame, energy);
+}
+
+static void differentialGrey() {
+  delete getDifferential(*grey);
+}
+
+static void differentialRgb() {
+  delete getDifferential(*color);
+}
+
+static void newState() {
+  delete state;
+  Frame<PixelValue>* energy = new Frame<PixelValue>;
+  *energy = *smallEnergy;
+  state = new EdmondsKarpFlowState(energy);
+}
+
+static void prepareGraph() {
+  state->prepare(FLOW_LEFT_RIGHT);
+}
+
+static void maxFlow() {
+  state->calcMaxFlow(FLOW_LEFT_RIGHT);
+}
+
+static void solvedState() {
+  newState();
+  state->calcMaxFlow(FLOW_LEFT_RIGHT);
+  cutSubject = *smallColor;
+}
+
+static void cutSeam() {
+  state->cutFrame(cutSubject);
+}
+
+// what the viewer does before wrapping a frame in a pixbuf
+static void toRgb() {
+  delete getRgb(greyWrapper);
+}
+
+struct Kernel {
+  const char* name;
+  void (*run)();
+  // untimed, before every run; may be NULL
+  void (*setup)();
+};
+
+static const Kernel kernels[] = {
+  { "parse_ppm", parsePpm, NULL },
+  { "parse_pgm", parsePgm, NULL },
+  { "parse_differential_ppm", parseDifferentialPpm, NULL },
+  { "parse_differential_pgm", parseDifferentialPgm, NULL },
+  { "differential_grey", differentialGrey, NULL },
+  { "differential_rgb", differentialRgb, NULL },
+  { "build_graph", prepareGraph, newState },
+  { "max_flow", maxFlow, newState },
+  { "cut_frame", cutSeam, solvedState },
+  { "to_rgb", toRgb, NULL }
+};
+
+struct Result {
+  // microseconds
+  double median;
+  // median absolute deviation from median
+  double mad;
+};
+
+typedef map<string, Result> ResultSet;
+
+static double getMedian(vector<double> v) {
+  sort(v.begin(), v.end());
+  size_t n = v.size();
+  return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static Result measure(const Kernel& k, size_t warmup, size_t repetitions) {
+  typedef chrono::steady_clock Clock;
+  vector<double> times;
+  for (size_t i = 0; i < warmup + repetitions; i++) {
+    if (k.setup != NULL) k.setup();
+    Clock::time_point start = Clock::now();
+    k.run();
+    Clock::duration d = Clock::now() - start;
+    if (i >= warmup) {
+      times.push_back(chrono::duration_cast<chrono::nanoseconds>(d).count()
+                      / 1000.0);
+    }
+  }
+  Result r;
+  r.median = getMedian(times);
+  for (size_t i = 0; i < times.size(); i++) {
+    times[i] = fabs(times[i] - r.median);
+  }
+  r.mad = getMedian(times);
+  return r;
+}
+
+// Lines of "name median mad"; # starts a comment
+static bool readBaseline(const string& name, ResultSet& results) {
+  ifstream in(name.c_str());
+  if (!in) return false;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    istringstream is(line);
+    string kernel;
+    Result r;
+    if (is >> kernel >> r.median >> r.mad) {
+      results[kernel] = r;
+    }
+  }
+  return true;
+}
+
+static bool writeBaseline(const string& name, const ResultSet& results) {
+  ofstream out(name.c_str());
+  if (!out) return false;
+  out << "# kernel median_us mad_us, written by bench -s\n";
+  out << "# timings are only comparable on the machine that wrote them\n";
+  for (ResultSet::const_iterator i = results.begin(); i != results.end();
+       ++i) {
+    out << i->first << " " << i->second.median << " " << i->second.mad;
+    out << "\n";
+  }
+  return out.good();
+}
+
+static bool isRegression(const Result& base, const Result& now,
+                         double threshold) {
+  double noise = significance * max(base.mad, now.mad);
+  return now.median > base.median * (1 + threshold) &&
+         now.median - base.median > noise;
+}
+
+/* Energy of a w x h image: plateaus of the given number of levels, or a
+   gradient for 0, with noise of the given amplitude, under blocks of the
+   given contrast. */
+static Frame<PixelValue>* makeTrainingEnergy(size_t w, size_t h,
+                                             const unsigned int* texture) {
+  unsigned int levels = texture[0], noise = texture[1];
+  unsigned int contrast = texture[2];
+  Frame<PixelValue> image(w, h);
+  unsigned int seed = 54321;
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      seed = seed * 1103515245 + 12345;
+      unsigned int v;
+      if (levels > 0) {
+        double waves = sin(x * 2 * M_PI / w * 1.7) +
+                       cos(y * 2 * M_PI / h * 1.3) +
+                       sin((x + y) * 2 * M_PI / (w + h) * 2.9);
+        v = (unsigned int)((waves + 3) / 6 * levels) * 255 / levels;
+      } else {
+        v = x * 128 / w + y * 64 / h;
+      }
+      if (noise > 0) v += (seed >> 16) % noise;
+      if (((x / 20) + (y / 15)) % 2) v += contrast;
+      image.values[x + y * w] = (v > 0xff) ? 0xff : v;
+    }
+  }
+  return getDifferential(image);
+}
+
+// Median microseconds of calcMaxFlow on a fresh state
+static double timeSolve(const Frame<PixelValue>& energy,
+                        MaxFlowAlogorithm algorithm) {
+  typedef chrono::steady_clock Clock;
+  vector<double> times;
+  for (size_t i = 0; i < model_repetitions; i++) {
+    Frame<PixelValue>* copy = new Frame<PixelValue>;
+    *copy = energy;
+    FlowState* solver = getNewFlowState(copy, algorithm);
+    Clock::time_point start = Clock::now();
+    solver->calcMaxFlow(FLOW_LEFT_RIGHT);
+    Clock::duration d = Clock::now() - start;
+    times.push_back(chrono::duration_cast<chrono::nanoseconds>(d).count()
+                    / 1000.0);
+    delete solver;
+  }
+  return getMedian(times);
+}
+
+/* Times every algorithm on images from flat to dense texture and writes
+   the least squares cost model to name. */
+static bool fitModel(const string& name) {
+  const MaxFlowAlogorithm algorithms[] = { EDMONDS_KARP, IBFS, REGION };
+  const size_t sizes[][2] = {
+    { 80, 60 }, { 160, 120 }, { 240, 180 }, { 320, 240 }
+  };
+  // levels, noise and contrast, see makeTrainingEnergy
+  const unsigned int textures[][3] = {
+    { 0, 0, 0 }, { 0, 0, 192 }, { 0, 16, 0 }, { 0, 96, 64 }, { 0, 255, 0 },
+    { 8, 0, 0 }, { 8, 4, 0 }, { 8, 16, 0 }, { 16, 4, 64 }
+  };
+
+  vector<Frame<PixelValue>*> energies;
+  vector<vector<double> > features;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (size_t j = 0; j < sizeof(textures) / sizeof(textures[0]); j++) {
+      Frame<PixelValue>* energy =
+        makeTrainingEnergy(sizes[i][0], sizes[i][1], textures[j]);
+      vector<double> f(COST_FEATURES);
+      getCostFeatures(getEnergyStats(*energy), &f[0]);
+      energies.push_back(energy);
+      features.push_back(f);
+    }
+  }
+
+  CostModel model;
+  bool ok = true;
+  for (size_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++) {
+    vector<double> times;
+    for (size_t i = 0; i < energies.size(); i++) {
+      times.push_back(timeSolve(*energies[i], algorithms[a]));
+    }
+    vector<double> coefficients;
+    if (!fitCost(features, times, coefficients)) {
+      cout << "Could not fit " << getAlgorithmName(algorithms[a]) << "\n";
+      ok = false;
+      continue;
+    }
+    model.coefficients[algorithms[a]] = coefficients;
+    for (size_t i = 0; i < energies.size(); i++) {
+      const Frame<PixelValue>& e = *energies[i];
+      cout << getAlgorithmName(algorithms[a]) << " " << e.w << "x" << e.h;
+      cout << ": " << times[i] << " us, predicted ";
+      cout << predictCost(model, algorithms[a], getEnergyStats(e));
+      cout << " us\n";
+    }
+  }
+  for (size_t i = 0; i < energies.size(); i++) {
+    delete energies[i];
+  }
+  if (!ok) return false;
+
+  ofstream out(name.c_str());
+  if (!out) return false;
+  out << "# algorithm and log microseconds per calcMaxFlow per feature (see\n";
+  out << "# getCostFeatures), written by bench -m on the machine it ran on\n";
+  printCostModel(model, out);
+  return out.good();
+}
+
+// Median seconds to carve sweep_seams columns from image
+static double timeCarve(const Frame<RgbPixel>& image) {
+  typedef chrono::steady_clock Clock;
+  vector<double> times;
+  for (size_t i = 0; i < model_repetitions; i++) {
+    Frame<RgbPixel> subject = image;
+    EdmondsKarpFlowState solver(getDifferential(subject));
+    Clock::time_point start = Clock::now();
+    for (size_t j = 0; j < sweep_seams; j++) {
+      solver.calcMaxFlow(FLOW_LEFT_RIGHT);
+      solver.cutFrame(subject);
+    }
+    times.push_back(chrono::duration<double>(Clock::now() - start).count());
+  }
+  return getMedian(times);
+}
+
+/* Carves with the large buffers file backed past caps (test -m) from the
+   whole predicted footprint down to none of it */
+static void sweepCap() {
+  const double ratios[] = { 1, 0.75, 0.5, 0.25, 0 };
+  // half the test image each way, so that the sweep takes seconds
+  Frame<RgbPixel> image(color->w / 2, color->h / 2);
+  for (size_t y = 0; y < image.h; y++) {
+    for (size_t x = 0; x < image.w; x++) {
+      image.values[x + y * image.stride] = color->values[x + y * color->w];
+    }
+  }
+  Footprint f = predictFootprint(image.w, image.h, true, EDMONDS_KARP,
+                                 DEFAULT_NODE_LAYOUT);
+  setStorageMode(STORAGE_HEAP);
+  double heap = timeCarve(image);
+  cout << image.w << "x" << image.h << ", " << (f.totalBytes >> 10);
+  cout << " KiB predicted\n";
+  cout << "heap: " << sweep_seams / heap << " seams/s\n";
+  setStorageMode(STORAGE_MAPPED);
+  for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); i++) {
+    size_t cap = (size_t)(f.totalBytes * ratios[i]);
+    setStorageMemoryCap(cap);
+    size_t mapped = getStorageStats().mappedBuffers;
+    double t = timeCarve(image);
+    mapped = getStorageStats().mappedBuffers - mapped;
+    cout << "cap " << ratios[i] * 100 << "% (" << (cap >> 10) << " KiB): ";
+    cout << sweep_seams / t << " seams/s, " << heap / t * 100;
+    cout << "% of heap, " << mapped / model_repetitions;
+    cout << " buffers file backed per carve\n";
+  }
+}
+
+void print_help() {
+  cout << "\t-h\tPrint this help.\n";
+  cout << "\t-w\tSpecify warmup runs per kernel (default: ";
+  cout << default_warmup << ")\n";
+  cout << "\t-r\tSpecify timed runs per kernel (default: ";
+  cout << default_repetitions << ")\n";
+  cout << "\t-k\tOnly run kernels whose name contains this\n";
+  cout << "\t-b\tCompare with this baseline; exit 1 on a regression\n";
+  cout << "\t-t\tSpecify the regression threshold in percent (default: ";
+  cout << default_threshold * 100 << ")\n";
+  cout << "\t-s\tSave the results as a baseline to this file\n";
+  cout << "\t-m\tFit the cost model of -a auto and save it to this file, ";
+  cout << "instead of running the kernels\n";
+  cout << "\t-c\tTime carving under memory caps from the whole predicted ";
+  cout << "footprint down to none, instead of running the kernels\n";
+}
+
+int main(int argc, char** argv) {
+  size_t warmup = default_warmup;
+  size_t repetitions = default_repetitions;
+  double threshold = default_threshold;
+  string filter, baselinefilename, savefilename, modelfilename;
+  bool sweep = false;
+  int c;
+
+  while ((c = getopt(argc, argv, "w:r:k:b:t:s:m:ch")) != -1) {
+    switch (c) {
+    case 'h':
+      print_help();
+      return 0;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'r':
+      repetitions = atoi(optarg);
+      if (repetitions == 0) repetitions = 1;
+      break;
+    case 'k':
+      filter = optarg;
+      break;
+    case 'b':
+      baselinefilename = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg) / 100;
+      break;
+    case 's':
+      savefilename = optarg;
+      break;
+    case 'm':
+      modelfilename = optarg;
+      break;
+    case 'c':
+      sweep = true;
+      break;
+    default:
+      return 1;
+    }
+  }
+
+  if (!modelfilename.empty()) {
+    cout.precision(1);
+    cout.setf(ios::fixed);
+    if (!fitModel(modelfilename)) {
+      cout << "Failed to write cost model " << modelfilename << "\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  ResultSet baseline;
+  if (!baselinefilename.empty() && !readBaseline(baselinefilename, baseline)) {
+    cout << "Failed to read baseline " << baselinefilename << "\n";
+    return 1;
+  }
+
+  makeInputs();
+  if (sweep) {
+    cout.precision(1);
+    cout.setf(ios::fixed);
+    sweepCap();
+    return 0;
+  }
+
+  ResultSet results;
+  bool regressed = false;
+  cout.setf(ios::fixed);
+  cout.precision(1);
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    const Kernel& k = kernels[i];
+    if (string(k.name).find(filter) == string::npos) continue;
+    Result r = measure(k, warmup, repetitions);
+    results[k.name] = r;
+    cout << k.name << ": " << r.median << " us (+-" << r.mad << ")";
+    ResultSet::const_iterator b = baseline.find(k.name);
+    if (b != baseline.end()) {
+      const Result& base = b->second;
+      cout << ", baseline " << base.median << " us, ";
+      cout << showpos << (r.median / base.median - 1) * 100 << noshowpos;
+      cout << "%";
+      if (isRegression(base, r, threshold)) {
+        cout << " REGRESSED";
+        regressed = true;
+      }
+    }
+    cout << "\n";
+  }
+
+  delete state;
+  delete color;
+  delete grey;
+  delete smallColor;
+  delete smallEnergy;
+
+  if (!savefilename.empty() && !writeBaseline(savefilename, results)) {
+    cout << "Failed to write baseline " << savefilename << "\n";
+    return 1;
+  }
+  return regressed ? 1 : 0;
+}
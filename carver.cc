@@ -0,0 +1,224 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "carver.h"
+
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <chrono>
+
+#include "energy.h"
+#include "diff.h"
+#include "costmodel.h"
+#include "speculative.h"
+
+using namespace std;
+
+struct carver_context {
+  MaxFlowAlogorithm algorithm;
+  NodeLayout layout;
+  // Kept between calls so that the points and frames keep their room
+  FlowState* state;
+  MaxFlowAlogorithm stateAlgorithm;
+  // us per max flow of the last carve, as predicted by the cost model
+  double predicted;
+  // both directions are solved at each step, on a SpeculativeFlowState
+  bool cheapest;
+  // ms; 0 for none
+  double budget;
+  carver_progress progress;
+  void* progressData;
+  Frame<PixelValue> greyFrame;
+  Frame<RgbPixel> colorFrame;
+};
+
+// Reuses the context's state unless the algorithm changed
+static FlowState* getState(carver_context& ctx, Frame<PixelValue>* energy) {
+  MaxFlowAlogorithm algorithm =
+    resolveAlgorithm(ctx.algorithm, *energy, &ctx.predicted);
+  bool speculative =
+    dynamic_cast<SpeculativeFlowState*>(ctx.state) != NULL;
+  if (ctx.state != NULL && ctx.stateAlgorithm == algorithm &&
+      speculative == ctx.cheapest) {
+    delete ctx.state->energy;
+    ctx.state->energy = energy;
+  } else {
+    delete ctx.state;
+    if (ctx.cheapest) {
+      ctx.state = new SpeculativeFlowState(energy, algorithm);
+    } else {
+      ctx.state = getNewFlowState(energy, algorithm);
+    }
+    ctx.stateAlgorithm = algorithm;
+  }
+  ctx.state->layout = ctx.layout;
+  if (ctx.progress != NULL) {
+    carver_progress fn = ctx.progress;
+    void* data = ctx.progressData;
+    ctx.state->progress = [fn, data](FlowState::EnergyType flow) {
+      return fn(data, flow) != 0;
+    };
+  } else {
+    ctx.state->progress = FlowState::ProgressCallback();
+  }
+  ctx.state->deadline = FlowState::Clock::time_point::max();
+  if (ctx.budget > 0) {
+    ctx.state->deadline = FlowState::Clock::now() +
+      chrono::duration_cast<FlowState::Clock::duration>(
+        chrono::duration<double, milli>(ctx.budget));
+  }
+  return ctx.state;
+}
+
+template<typename T>
+static int do_carve(carver_context& ctx, Frame<T>& frame,
+                    const unsigned char* in, size_t w, size_t h,
+                    size_t in_stride, unsigned char* out, size_t out_w,
+                    size_t out_h, size_t out_stride) {
+  if (in_stride < w * sizeof(T) || out_stride < out_w * sizeof(T)) {
+    return CARVER_INVALID;
+  }
+
+  frame.w = frame.stride = w;
+  frame.h = h;
+  frame.values.resize(w * h);
+  for (size_t y = 0; y < h; y++) {
+    const T* row = reinterpret_cast<const T*>(in + y * in_stride);
+    copy(row, row + w, frame.values.begin() + y * frame.stride);
+  }
+
+  // seams are removed in place, so the frames keep their stride
+  FlowState* state = getState(ctx, getDifferential(frame));
+  SpeculativeFlowState* speculative =
+    dynamic_cast<SpeculativeFlowState*>(state);
+  Seam seam;
+  bool approximate = false;
+  while (frame.w > out_w || frame.h > out_h) {
+    if (speculative != NULL && frame.w > out_w && frame.h > out_h) {
+      speculative->calcCheaperFlow();
+    } else {
+      state->calcMaxFlow((frame.w > out_w) ? FLOW_LEFT_RIGHT
+                                           : FLOW_TOP_BOTTOM);
+    }
+    state->cutFrame(frame, &seam);
+    approximate = approximate || seam.approximate;
+  }
+
+  for (size_t y = 0; y < out_h; y++) {
+    typename Frame<T>::ValuesSet::const_iterator row =
+      frame.values.begin() + y * frame.stride;
+    copy(row, row + out_w, reinterpret_cast<T*>(out + y * out_stride));
+  }
+  return approximate ? CARVER_APPROXIMATE : CARVER_OK;
+}
+
+carver_context* carver_new_context(void) {
+  carver_context* ctx = new carver_context;
+  ctx->algorithm = DEFAULT_ALGORITHM;
+  ctx->layout = DEFAULT_NODE_LAYOUT;
+  ctx->state = NULL;
+  ctx->stateAlgorithm = DEFAULT_ALGORITHM;
+  ctx->predicted = -1;
+  ctx->cheapest = false;
+  ctx->budget = 0;
+  ctx->progress = NULL;
+  ctx->progressData = NULL;
+  return ctx;
+}
+
+void carver_free_context(carver_context* ctx) {
+  if (ctx == NULL) return;
+  delete ctx->state;
+  delete ctx;
+}
+
+int carver_set_algorithm(carver_context* ctx, const char* name) {
+  if (ctx == NULL || name == NULL ||
+      !parseAlgorithm(name, ctx->algorithm)) {
+    return CARVER_INVALID;
+  }
+  return CARVER_OK;
+}
+
+int carver_set_layout(carver_context* ctx, const char* name) {
+  if (ctx == NULL || name == NULL || !parseNodeLayout(name, ctx->layout)) {
+    return CARVER_INVALID;
+  }
+  return CARVER_OK;
+}
+
+int carver_set_time_budget(carver_context* ctx, double ms) {
+  if (ctx == NULL || ms < 0) return CARVER_INVALID;
+  ctx->budget = ms;
+  return CARVER_OK;
+}
+
+int carver_set_progress(carver_context* ctx, carver_progress fn,
+                        void* data) {
+  if (ctx == NULL) return CARVER_INVALID;
+  ctx->progress = fn;
+  ctx->progressData = data;
+  return CARVER_OK;
+}
+
+int carver_set_cheapest_first(carver_context* ctx, int enable) {
+  if (ctx == NULL) return CARVER_INVALID;
+  ctx->cheapest = (enable != 0);
+  return CARVER_OK;
+}
+
+int carver_get_last_algorithm(carver_context* ctx, const char** name,
+                              double* predicted_us) {
+  if (ctx == NULL || ctx->state == NULL) return CARVER_INVALID;
+  if (name != NULL) *name = getAlgorithmName(ctx->stateAlgorithm);
+  if (predicted_us != NULL) *predicted_us = ctx->predicted;
+  return CARVER_OK;
+}
+
+int carver_load_cost_model(const char* filename) {
+  if (filename == NULL) return CARVER_INVALID;
+  ifstream in(filename);
+  CostModel model;
+  if (!in || !loadCostModel(in, model)) return CARVER_INVALID;
+  setCostModel(model);
+  return CARVER_OK;
+}
+
+int carver_carve(carver_context* ctx, enum carver_format format,
+                 const unsigned char* in, size_t w, size_t h,
+                 size_t in_stride, unsigned char* out, size_t out_w,
+                 size_t out_h, size_t out_stride) {
+  if (ctx == NULL || in == NULL || out == NULL || out_w == 0 ||
+      out_h == 0 || out_w > w || out_h > h) {
+    return CARVER_INVALID;
+  }
+  switch (format) {
+  case CARVER_GREY:
+    return do_carve(*ctx, ctx->greyFrame, in, w, h, in_stride, out, out_w,
+                    out_h, out_stride);
+  case CARVER_RGB:
+    return do_carve(*ctx, ctx->colorFrame, in, w, h, in_stride, out, out_w,
+                    out_h, out_stride);
+  default:
+    return CARVER_INVALID;
+  }
+}
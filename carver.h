@@ -0,0 +1,98 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _CARVER_H
+#define _CARVER_H
+
+/* C interface for carving images in memory. Link with libcarver.a or
+   libcarver.so; libcarver.a also needs -lstdc++ -pthread. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Holds the solver allocations between calls. Not thread safe.
+typedef struct carver_context carver_context;
+
+enum carver_format {
+  // one byte per pixel
+  CARVER_GREY = 1,
+  // r, g, b bytes per pixel
+  CARVER_RGB = 3
+};
+
+enum carver_status {
+  CARVER_OK = 0,
+  // carved, but at least one seam is the cheapest path rather than a
+  // min cut, because the time budget ran out or progress said stop
+  CARVER_APPROXIMATE = 1,
+  // bad arguments, unknown names, or a target larger than the input
+  CARVER_INVALID = -1
+};
+
+carver_context* carver_new_context(void);
+void carver_free_context(carver_context* ctx);
+
+// Names as taken by test -a and -l
+int carver_set_algorithm(carver_context* ctx, const char* name);
+int carver_set_layout(carver_context* ctx, const char* name);
+
+/* Each carver_carve may take about this long; past it the remaining seams
+   are cheap approximations. 0 for no limit. */
+int carver_set_time_budget(carver_context* ctx, double ms);
+
+/* Called now and then during each max flow with data and the flow so far.
+   Returning 0 makes that seam approximate. fn may be NULL. */
+typedef int (*carver_progress)(void* data, unsigned long flow);
+int carver_set_progress(carver_context* ctx, carver_progress fn,
+                        void* data);
+
+/* Nonzero removes whichever of a column and a row is cheaper while both
+   are to be cut, solving both at once on two threads. 0, the default,
+   removes all columns first. */
+int carver_set_cheapest_first(carver_context* ctx, int enable);
+
+/* Cost model, as written by bench -m, for the "auto" algorithm. Shared by
+   all contexts; without one "auto" is "ek". */
+int carver_load_cost_model(const char* filename);
+
+/* The algorithm the last carver_carve ran, named as for
+   carver_set_algorithm, and for "auto" the microseconds per max flow the
+   cost model predicted for it, otherwise -1. Either pointer may be NULL.
+   CARVER_INVALID before the first carve. */
+int carver_get_last_algorithm(carver_context* ctx, const char** name,
+                              double* predicted_us);
+
+/* Carves the w x h image in to out_w x out_h and writes it to out, which
+   may not overlap in. Strides are in bytes. Columns are removed before
+   rows, unless carver_set_cheapest_first is on. */
+int carver_carve(carver_context* ctx, enum carver_format format,
+                 const unsigned char* in, size_t w, size_t h,
+                 size_t in_stride, unsigned char* out, size_t out_w,
+                 size_t out_h, size_t out_stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,19 +25,86 @@
 enum MaxFlowAlogorithm {
   EDMONDS_KARP,
   PUSH_RELABEL,
+  IBFS,
+  REGION,
+  // picked per image by the cost model, see costmodel.h
+  AUTOMATIC,
 };
 
 #define DEFAULT_ALGORITHM EDMONDS_KARP
 
+enum FlowDirection {
+  FLOW_LEFT_RIGHT,
+  FLOW_TOP_BOTTOM
+};
+
+// Order of the solver nodes in FlowState::points
+enum NodeLayout {
+  LAYOUT_ROW_MAJOR,
+  // NODE_TILE x NODE_TILE tiles, row-major inside and between tiles
+  LAYOUT_TILED,
+  // as LAYOUT_TILED, but Z-order inside each tile
+  LAYOUT_MORTON
+};
+
+#define DEFAULT_NODE_LAYOUT LAYOUT_ROW_MAJOR
+
+// Per node solver work, kept in FlowState::work when countWork is set
+enum WorkCounter {
+  // queued to grow its tree
+  WORK_ACTIVATED,
+  // lost its parent
+  WORK_ORPHANED,
+  // looked for a new parent as an orphan
+  WORK_ADOPTIONS,
+  // on an augmenting path
+  WORK_PATHS,
+  NUM_WORK_COUNTERS
+};
+
+#define DEFAULT_WORK_COUNTER WORK_ORPHANED
+// Tiles are 1 << NODE_TILE_BITS nodes wide (at most 8)
+#define NODE_TILE_BITS 4
+
 // Best parent is an improvement in speed
 #define EDMONDS_KARP_BEST_PARENT true
 // Use the heuristic algorithm
 #define EDMONDS_KARP_USE_HEURISTIC true
 // Reassign parents (requires heuristic)
 #define EDMONDS_KARP_REASSIGN_PARENTS true
+// Start with the fattest augmenting paths (EdmondsKarpFlowState::scaling)
+#define EDMONDS_KARP_CAPACITY_SCALING false
+// Augmenting paths (or, for IBFS, scanned nodes) between checks of the
+// deadline and progress callback
+#define FLOW_CHECK_INTERVAL 64
+// Thinnest band, in rows or columns, the region solver splits off
+#define REGION_MIN_SIZE 32
+// Energies the cost model counts as edges, and as flat
+#define COST_EDGE_ENERGY 64
+#define COST_FLAT_ENERGY 8
+// Read by test -a auto unless another file is given
+#define DEFAULT_COST_MODEL "cost.model"
 
 
 // More efficient
 #define PNM_BINARY_DEFAULT true
 
+#define DEFAULT_STORAGE_MODE STORAGE_HEAP
+// Smaller buffers are always on the heap
+#define STORAGE_MIN_MAPPED_BYTES (1 << 20)
+// Rows processed between releases of file backed frame pages
+#define STORAGE_TILE_ROWS 64
+// Side of the square tiles transposeFrame copies at a time; a tile of
+// each frame should stay in L1
+#define TRANSPOSE_BLOCK 32
+// interactive carves larger images on a proxy of about this many pixels
+// first, and shows it until the full size carve is done
+#define PREVIEW_MAX_PIXELS (1 << 16)
+// ms each proxy seam may take before the cheapest path is cut instead
+#define PREVIEW_BUDGET_MS 20
+// interactive carves this many seams past the size slider while idle
+#define PRECOMPUTE_AHEAD_SEAMS 32
+// and carves on once the slider is within this many of the last one
+#define PRECOMPUTE_AHEAD_RESUME 8
+
 #endif
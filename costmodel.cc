@@ -0,0 +1,173 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "costmodel.h"
+
+#include <cmath>
+#include <string>
+#include <sstream>
+
+#include "energy.h"
+
+using namespace std;
+
+static CostModel model;
+
+EnergyStats getEnergyStats(const Frame<PixelValue>& energy) {
+  size_t histogram[256] = { 0 };
+  for (size_t y = 0; y < energy.h; y++) {
+    Frame<PixelValue>::ValuesSet::const_iterator row =
+      energy.values.begin() + y * energy.stride;
+    for (Frame<PixelValue>::ValuesSet::const_iterator i = row;
+         i != row + energy.w; ++i) {
+      histogram[*i]++;
+    }
+  }
+
+  EnergyStats stats;
+  stats.w = energy.w;
+  stats.h = energy.h;
+  size_t n = energy.w * energy.h, sum = 0, edges = 0, flat = 0;
+  for (size_t v = 0; v < 256; v++) {
+    sum += v * histogram[v];
+    if (v >= COST_EDGE_ENERGY) edges += histogram[v];
+    if (v < COST_FLAT_ENERGY) flat += histogram[v];
+  }
+  stats.mean = n ? (double)sum / n / 255 : 0;
+  stats.edges = n ? (double)edges / n : 0;
+  stats.flat = n ? (double)flat / n : 0;
+  return stats;
+}
+
+void getCostFeatures(const EnergyStats& stats, double* features) {
+  features[0] = 1;
+  features[1] = log(stats.w * stats.h / 1e6);
+  features[2] = stats.mean;
+  features[3] = stats.edges;
+  features[4] = stats.flat;
+}
+
+bool loadCostModel(istream& is, CostModel& result) {
+  string line;
+  while (getline(is, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    istringstream fields(line);
+    string name;
+    MaxFlowAlogorithm algorithm;
+    fields >> name;
+    if (!parseAlgorithm(name, algorithm) || algorithm == AUTOMATIC) {
+      return false;
+    }
+    vector<double> coefficients(COST_FEATURES);
+    for (size_t i = 0; i < COST_FEATURES; i++) {
+      if (!(fields >> coefficients[i])) return false;
+    }
+    result.coefficients[algorithm] = coefficients;
+  }
+  return true;
+}
+
+void printCostModel(const CostModel& m, ostream& os) {
+  for (CostModel::CoefficientSet::const_iterator i = m.coefficients.begin();
+       i != m.coefficients.end(); ++i) {
+    os << getAlgorithmName(i->first);
+    for (size_t j = 0; j < i->second.size(); j++) {
+      os << " " << i->second[j];
+    }
+    os << "\n";
+  }
+}
+
+bool fitCost(const vector<vector<double> >& features,
+             const vector<double>& times, vector<double>& coefficients) {
+  const size_t k = COST_FEATURES;
+  if (features.size() < k || features.size() != times.size()) return false;
+
+  // normal equations, augmented with the right hand side
+  vector<vector<double> > a(k, vector<double>(k + 1, 0));
+  for (size_t s = 0; s < features.size(); s++) {
+    for (size_t i = 0; i < k; i++) {
+      for (size_t j = 0; j < k; j++) {
+        a[i][j] += features[s][i] * features[s][j];
+      }
+      a[i][k] += features[s][i] * log(times[s]);
+    }
+  }
+
+  // Gaussian elimination with partial pivoting
+  for (size_t c = 0; c < k; c++) {
+    size_t pivot = c;
+    for (size_t r = c + 1; r < k; r++) {
+      if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+    }
+    if (fabs(a[pivot][c]) < 1e-12) return false;
+    a[c].swap(a[pivot]);
+    for (size_t r = 0; r < k; r++) {
+      if (r == c) continue;
+      double f = a[r][c] / a[c][c];
+      for (size_t j = c; j <= k; j++) {
+        a[r][j] -= f * a[c][j];
+      }
+    }
+  }
+  coefficients.resize(k);
+  for (size_t i = 0; i < k; i++) {
+    coefficients[i] = a[i][k] / a[i][i];
+  }
+  return true;
+}
+
+double predictCost(const CostModel& m, MaxFlowAlogorithm algorithm,
+                   const EnergyStats& stats) {
+  CostModel::CoefficientSet::const_iterator c = m.coefficients.find(algorithm);
+  if (c == m.coefficients.end()) return -1;
+  double features[COST_FEATURES];
+  getCostFeatures(stats, features);
+  double cost = 0;
+  for (size_t i = 0; i < COST_FEATURES; i++) {
+    cost += c->second[i] * features[i];
+  }
+  return exp(cost);
+}
+
+MaxFlowAlogorithm pickAlgorithm(const CostModel& m, const EnergyStats& stats,
+                                double* predicted) {
+  MaxFlowAlogorithm best = DEFAULT_ALGORITHM;
+  double bestCost = -1;
+  for (CostModel::CoefficientSet::const_iterator i = m.coefficients.begin();
+       i != m.coefficients.end(); ++i) {
+    double cost = predictCost(m, i->first, stats);
+    if (bestCost < 0 || cost < bestCost) {
+      best = i->first;
+      bestCost = cost;
+    }
+  }
+  if (predicted != NULL) *predicted = bestCost;
+  return best;
+}
+
+void setCostModel(const CostModel& m) {
+  model = m;
+}
+
+const CostModel& getCostModel() {
+  return model;
+}
@@ -0,0 +1,84 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _COSTMODEL_H
+#define _COSTMODEL_H
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include <istream>
+#include <ostream>
+
+#include "const.h"
+#include "frame.h"
+
+// Cheap statistics of an energy map, from its histogram
+struct EnergyStats {
+  std::size_t w;
+  std::size_t h;
+  // mean energy, from 0 to 1
+  double mean;
+  // fraction of pixels with at least COST_EDGE_ENERGY
+  double edges;
+  // fraction of pixels with less than COST_FLAT_ENERGY
+  double flat;
+};
+
+EnergyStats getEnergyStats(const Frame<PixelValue>& energy);
+
+#define COST_FEATURES 5
+/* Terms that the cost model weighs: a constant, the log of the number of
+   megapixels, the mean, and the edge and flat fractions. */
+void getCostFeatures(const EnergyStats& stats, double* features);
+
+/* Log of the microseconds per calcMaxFlow of each algorithm, as a linear
+   function of the features. Fitted by bench -m on the machine it runs
+   on. */
+struct CostModel {
+  typedef std::map<MaxFlowAlogorithm, std::vector<double> > CoefficientSet;
+  CoefficientSet coefficients;
+};
+
+// Lines of "algorithm coefficients..."; # starts a comment
+bool loadCostModel(std::istream& is, CostModel& model);
+void printCostModel(const CostModel& model, std::ostream& os);
+
+/* Least squares coefficients for the log of times (in microseconds) of
+   samples with the given features. Returns false if they don't pin them
+   down. */
+bool fitCost(const std::vector<std::vector<double> >& features,
+             const std::vector<double>& times,
+             std::vector<double>& coefficients);
+
+// Microseconds; negative if model has no coefficients for algorithm
+double predictCost(const CostModel& model, MaxFlowAlogorithm algorithm,
+                   const EnergyStats& stats);
+/* The algorithm of model predicted to be fastest, or DEFAULT_ALGORITHM if
+   model is empty. predicted may be NULL. */
+MaxFlowAlogorithm pickAlgorithm(const CostModel& model,
+                                const EnergyStats& stats, double* predicted);
+
+// Model that getNewFlowState uses for AUTOMATIC; empty until set
+void setCostModel(const CostModel& model);
+const CostModel& getCostModel();
+
+#endif
@@ -21,105 +21,489 @@
  */
 #include "diff.h"
 
+#include <algorithm>
+#include <fstream>
+
+#include "trace.h"
+
 using namespace std;
 
-Frame<PixelValue>* getDifferential(const Frame<PixelValue>& frame) {
+static inline PixelValue pixelEnergy(const PixelValue& p,
+                                     const PixelValue& right,
+                                     const PixelValue& down) {
+  return (PixelValue)(abs(right - p) + abs(down - p));
+}
+
+static inline PixelValue pixelEnergy(const RgbPixel& p,
+                                     const RgbPixel& right,
+                                     const RgbPixel& down) {
+  int rv = abs(right.r - p.r) + abs(down.r - p.r);
+  int gv = abs(right.g - p.g) + abs(down.g - p.g);
+  int bv = abs(right.b - p.b) + abs(down.b - p.b);
+  return (PixelValue)max(rv, max(gv, bv));
+}
+
+static inline void invertPixel(PixelValue& p) {
+  p ^= 0xff;
+}
+
+static inline void invertPixel(RgbPixel& p) {
+  RgbPixel one;
+  one.r = 0xff;
+  one.g = 0xff;
+  one.b = 0xff;
+  p ^= one;
+}
+
+/* energy of every pixel in row except the last, which has no right
+   neighbor. Branch free so that it can be vectorized. */
+template<typename T>
+static void rowDifferential(const T* row, const T* next, PixelValue* out,
+                            size_t w) {
+  for (size_t x = 0; x + 1 < w; x++) {
+    out[x] = pixelEnergy(row[x], row[x+1], next[x]);
+  }
+}
+
+template<typename T>
+static Frame<PixelValue>* do_getDifferential(const Frame<T>& frame) {
+  TraceScope trace("getDifferential");
   Frame<PixelValue>* result = new Frame<PixelValue>(frame.w, frame.h);
-  for (size_t y = 0; y < frame.h; y++) {
-    for (size_t x = 0; x < frame.w; x++) {
-      if (x == frame.w-1 || y == frame.h-1) {
-        result->values[x + y * frame.w] = 0xff;
-      } else {
-        int v = abs(frame.values[(x+1)+frame.w*y] -
-                    frame.values[x+frame.w*y]) +
-                abs(frame.values[x+frame.w*(y+1)] -
-                    frame.values[x+frame.w*y]);
-        result->values[x + y * frame.w] = (PixelValue)v;
-      }
+  if (frame.w == 0 || frame.h == 0) return result;
+  for (size_t y = 0; y + 1 < frame.h; y++) {
+    const T* row = &frame.values[y * frame.stride];
+    PixelValue* out = &result->values[y * result->stride];
+    rowDifferential(row, row + frame.stride, out, frame.w);
+    out[frame.w - 1] = 0xff;
+    if (y % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+      releaseRows(frame, y + 1 - STORAGE_TILE_ROWS, y);
+      releaseRows(*result, y + 1 - STORAGE_TILE_ROWS, y + 1);
     }
   }
+  PixelValue* last = &result->values[(frame.h - 1) * result->stride];
+  fill(last, last + frame.w, 0xff);
   return result;
 }
 
-Frame<PixelValue>* getDifferential(const Frame<RgbPixel>& frame) {
-  Frame<PixelValue>* result = new Frame<PixelValue>(frame.w, frame.h);
-  for (size_t y = 0; y < frame.h; y++) {
-    for (size_t x = 0; x < frame.w; x++) {
-      if (x == frame.w-1 || y == frame.h-1) {
-        result->values[x + y * frame.w] = 0xff;
-      } else {
-        int rv = abs(frame.values[(x+1)+frame.w*y].r -
-                     frame.values[x+frame.w*y].r) +
-                 abs(frame.values[x+frame.w*(y+1)].r -
-                     frame.values[x+frame.w*y].r);
-        int gv = abs(frame.values[(x+1)+frame.w*y].g -
-                     frame.values[x+frame.w*y].g) +
-                 abs(frame.values[x+frame.w*(y+1)].g -
-                     frame.values[x+frame.w*y].g);
-        int bv = abs(frame.values[(x+1)+frame.w*y].b -
-                     frame.values[x+frame.w*y].b) +
-                 abs(frame.values[x+frame.w*(y+1)].b -
-                     frame.values[x+frame.w*y].b);
-        result->values[x + y * frame.w] = (PixelValue)max(rv, max(gv, bv));
+// For the loaders: fills energy up to the row above the last one in
+template<typename T>
+static function<void(const Frame<T>&, size_t)>
+getRowsDifferential(Frame<PixelValue>& energy, size_t& done) {
+  return [&energy, &done](const Frame<T>& frame, size_t rows) {
+    if (energy.w != frame.w || energy.h != frame.h) {
+      energy = Frame<PixelValue>(frame.w, frame.h);
+    }
+    for (; done + 1 < rows; done++) {
+      const T* row = &frame.values[done * frame.stride];
+      PixelValue* out = &energy.values[done * energy.stride];
+      rowDifferential(row, row + frame.stride, out, frame.w);
+      out[frame.w - 1] = 0xff;
+      if (done % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+        releaseRows(energy, done + 1 - STORAGE_TILE_ROWS, done + 1);
       }
     }
-  }
-  return result;
+  };
+}
+
+template<typename T>
+static void do_zeroFrame(Frame<T>& frame) {
+  fill(frame.values.begin(), frame.values.end(), T());
+}
+
+Frame<PixelValue>* getDifferential(const Frame<PixelValue>& frame) {
+  return do_getDifferential(frame);
+}
+
+Frame<PixelValue>* getDifferential(const Frame<RgbPixel>& frame) {
+  return do_getDifferential(frame);
 }
 
 Frame<PixelValue>* getDifferential(const FrameWrapper& frame) {
   if (frame.color) {
-    return getDifferential(*frame.colorFrame);
+    return getDifferential(frame.colorFrame);
   } else {
-    return getDifferential(*frame.greyFrame);
+    return getDifferential(frame.greyFrame);
   }
 }
 
-void zeroFrame(Frame<PixelValue>& frame) {
-  for (size_t y = 0; y < frame.h; y++) {
-    for (size_t x = 0; x < frame.w; x++) {
-      frame.values[x + frame.w * y] = 0;
+bool loadPnmDifferential(istream& is, FrameWrapper& frame,
+                         Frame<PixelValue>& energy) {
+  TraceScope trace("loadPnmDifferential");
+  Frame<PixelValue> result;
+  size_t done = 0;
+  string magic = getMagic(is);
+  if (magic == "P2" || magic == "P5") {
+    Frame<PixelValue> grey;
+    if (!loadPgm(is, grey, getRowsDifferential<PixelValue>(result, done))) {
+      return false;
+    }
+    frame = FrameWrapper(move(grey));
+  } else if (magic == "P3" || magic == "P6") {
+    Frame<RgbPixel> color;
+    if (!loadPpm(is, color, getRowsDifferential<RgbPixel>(result, done))) {
+      return false;
     }
+    frame = FrameWrapper(move(color));
+  } else {
+    return false;
+  }
+  // the last row has no row below, and an empty raster no rows at all
+  size_t w = frame.getWidth(), h = frame.getHeight();
+  if (result.w != w || result.h != h) {
+    result = Frame<PixelValue>(w, h);
   }
+  if (h > 0) {
+    fill(result.values.begin() + (h - 1) * result.stride,
+         result.values.begin() + (h - 1) * result.stride + w, 0xff);
+  }
+  energy = move(result);
+  return true;
 }
 
-void zeroFrame(Frame<RgbPixel>& frame) {
-  RgbPixel nil;
-  nil.r = 0;
-  nil.g = 0;
-  nil.b = 0;
-
-  for (size_t y = 0; y < frame.h; y++) {
-    for (size_t x = 0; x < frame.w; x++) {
-      frame.values[x + frame.w * y] = nil;
-    }
+bool readPnmDifferential(string name, FrameWrapper& frame,
+                         Frame<PixelValue>& energy) {
+  fstream ifile(name.c_str(), fstream::in | fstream::binary);
+  if (ifile.peek() != 'q') {
+    return loadPnmDifferential(ifile, frame, energy);
   }
+  ifile.close();
+  if (!readPnm(name, frame)) return false;
+  Frame<PixelValue>* result = getDifferential(frame);
+  energy = move(*result);
+  delete result;
+  return true;
+}
+
+void zeroFrame(Frame<PixelValue>& frame) {
+  do_zeroFrame(frame);
+}
+
+void zeroFrame(Frame<RgbPixel>& frame) {
+  do_zeroFrame(frame);
 }
 
 void zeroFrame(FrameWrapper& frame) {
   if (frame.color) {
-    zeroFrame(*frame.colorFrame);
+    zeroFrame(frame.colorFrame);
   } else {
-    zeroFrame(*frame.greyFrame);
+    zeroFrame(frame.greyFrame);
   }
 }
 
 void togglePixel(Frame<PixelValue>& frame, std::size_t x, std::size_t y) {
-  frame.values[x + frame.w * y] ^= 0xff;
+  invertPixel(frame.values[x + frame.stride * y]);
 }
 
 void togglePixel(Frame<RgbPixel>& frame, std::size_t x, std::size_t y) {
-  RgbPixel one;
-  one.r = 0xff;
-  one.g = 0xff;
-  one.b = 0xff;
-  frame.values[x + frame.w * y] ^= one;
+  invertPixel(frame.values[x + frame.stride * y]);
 }
 
 void togglePixel(FrameWrapper& frame, std::size_t x, std::size_t y) {
   if (frame.color) {
-    togglePixel(*frame.colorFrame, x, y);
+    togglePixel(frame.colorFrame, x, y);
+  } else {
+    togglePixel(frame.greyFrame, x, y);
+  }
+}
+
+template<typename T>
+static void do_removeSeam(const Frame<T>& from, Frame<T>& to,
+                          const Seam& seam) {
+  const vector<size_t>& pos = seam.positions;
+  typename Frame<T>::ValuesSet::const_iterator src = from.values.begin();
+  typename Frame<T>::ValuesSet::iterator dst = to.values.begin();
+  if (seam.direction == FLOW_LEFT_RIGHT) {
+    for (size_t y = 0; y < from.h; y++) {
+      typename Frame<T>::ValuesSet::const_iterator row = src + y * from.stride;
+      typename Frame<T>::ValuesSet::iterator out = dst + y * to.stride;
+      out = copy(row, row + pos[y], out);
+      copy(row + pos[y] + 1, row + from.w, out);
+      if (y % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+        releaseRows(from, y + 1 - STORAGE_TILE_ROWS, y + 1);
+        releaseRows(to, y + 1 - STORAGE_TILE_ROWS, y + 1);
+      }
+    }
+  } else {
+    for (size_t y = 0; y < to.h; y++) {
+      for (size_t x = 0; x < from.w; x++) {
+        size_t sy = (y < pos[x]) ? y : y + 1;
+        to.values[x + y * to.stride] = from.values[x + sy * from.stride];
+      }
+      if (y % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+        releaseRows(from, y + 1 - STORAGE_TILE_ROWS, y);
+        releaseRows(to, y + 1 - STORAGE_TILE_ROWS, y + 1);
+      }
+    }
+  }
+}
+
+template<typename T>
+static void do_removeSeam(Frame<T>& frame, const Seam& seam,
+                          vector<T>* removed) {
+  const vector<size_t>& pos = seam.positions;
+  typename Frame<T>::ValuesSet::iterator v = frame.values.begin();
+  if (removed != NULL) {
+    removed->resize(pos.size());
+    for (size_t i = 0; i < pos.size(); i++) {
+      (*removed)[i] = (seam.direction == FLOW_LEFT_RIGHT) ?
+                      v[pos[i] + i * frame.stride] :
+                      v[i + pos[i] * frame.stride];
+    }
+  }
+  if (seam.direction == FLOW_LEFT_RIGHT) {
+    for (size_t y = 0; y < frame.h; y++) {
+      typename Frame<T>::ValuesSet::iterator row = v + y * frame.stride;
+      copy(row + pos[y] + 1, row + frame.w, row + pos[y]);
+    }
+    frame.w--;
+  } else {
+    // walk rows rather than columns so the shift stays sequential
+    size_t top = *min_element(pos.begin(), pos.end());
+    for (size_t y = top; y < frame.h - 1; y++) {
+      for (size_t x = 0; x < frame.w; x++) {
+        if (y >= pos[x]) {
+          frame.values[x + y * frame.stride] =
+            frame.values[x + (y + 1) * frame.stride];
+        }
+      }
+    }
+    frame.h--;
+  }
+}
+
+template<typename T>
+static void do_insertSeam(Frame<T>& frame, const Seam& seam,
+                          const vector<T>& removed) {
+  const vector<size_t>& pos = seam.positions;
+  typename Frame<T>::ValuesSet::iterator v = frame.values.begin();
+  if (seam.direction == FLOW_LEFT_RIGHT) {
+    for (size_t y = 0; y < frame.h; y++) {
+      typename Frame<T>::ValuesSet::iterator row = v + y * frame.stride;
+      copy_backward(row + pos[y], row + frame.w, row + frame.w + 1);
+      row[pos[y]] = removed[y];
+    }
+    frame.w++;
+  } else {
+    size_t top = *min_element(pos.begin(), pos.end());
+    for (size_t y = frame.h; y > top; y--) {
+      for (size_t x = 0; x < frame.w; x++) {
+        if (y > pos[x]) {
+          frame.values[x + y * frame.stride] =
+            frame.values[x + (y - 1) * frame.stride];
+        }
+      }
+    }
+    for (size_t x = 0; x < frame.w; x++) {
+      frame.values[x + pos[x] * frame.stride] = removed[x];
+    }
+    frame.h++;
+  }
+}
+
+template<typename T>
+static void do_retargetFrame(const Frame<T>& from, Frame<T>& to,
+                             const vector<unsigned>& order,
+                             FlowDirection direction, unsigned count) {
+  // from may be to, so the size is read before it changes
+  size_t w = from.w, h = from.h;
+  if (direction == FLOW_LEFT_RIGHT) {
+    for (size_t y = 0; y < h; y++) {
+      size_t out = y * to.stride;
+      for (size_t x = 0; x < w; x++) {
+        if (order[x + y * w] >= count) {
+          to.values[out++] = from.values[x + y * from.stride];
+        }
+      }
+    }
+    to.w = w - count;
+    to.h = h;
+  } else {
+    // rows kept so far in each column; never ahead of y, so in place works
+    vector<size_t> rows(w, 0);
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        if (order[x + y * w] >= count) {
+          to.values[x + rows[x]++ * to.stride] =
+            from.values[x + y * from.stride];
+        }
+      }
+    }
+    to.w = w;
+    to.h = h - count;
+  }
+}
+
+template<typename T>
+static void do_drawSeam(const Seam& seam, Frame<T>& mask) {
+  zeroFrame(mask);
+  size_t w = mask.w, h = mask.h;
+  if (seam.direction == FLOW_LEFT_RIGHT) {
+    w--;
+  } else {
+    h--;
+  }
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      if ((seam.direction == FLOW_LEFT_RIGHT && x != seam.positions[y]) ||
+          (seam.direction == FLOW_TOP_BOTTOM && y != seam.positions[x])) {
+        togglePixel(mask, x, y);
+      }
+    }
+  }
+}
+
+template<typename T>
+static void do_transposeFrame(const Frame<T>& from, Frame<T>& to) {
+  TraceScope trace("transposeFrame");
+  to = Frame<T>(from.h, from.w);
+  for (size_t by = 0; by < from.h; by += TRANSPOSE_BLOCK) {
+    size_t ey = min(by + TRANSPOSE_BLOCK, from.h);
+    for (size_t bx = 0; bx < from.w; bx += TRANSPOSE_BLOCK) {
+      size_t ex = min(bx + TRANSPOSE_BLOCK, from.w);
+      for (size_t y = by; y < ey; y++) {
+        for (size_t x = bx; x < ex; x++) {
+          to.values[y + x * to.stride] = from.values[x + y * from.stride];
+        }
+      }
+    }
+  }
+}
+
+void removeSeam(const Frame<PixelValue>& from, Frame<PixelValue>& to,
+                const Seam& seam) {
+  do_removeSeam(from, to, seam);
+}
+
+void removeSeam(const Frame<RgbPixel>& from, Frame<RgbPixel>& to,
+                const Seam& seam) {
+  do_removeSeam(from, to, seam);
+}
+
+void removeSeam(Frame<PixelValue>& frame, const Seam& seam) {
+  do_removeSeam(frame, seam, (vector<PixelValue>*)NULL);
+}
+
+void removeSeam(Frame<RgbPixel>& frame, const Seam& seam) {
+  do_removeSeam(frame, seam, (vector<RgbPixel>*)NULL);
+}
+
+void removeSeam(Frame<PixelValue>& frame, const Seam& seam,
+                vector<PixelValue>& removed) {
+  do_removeSeam(frame, seam, &removed);
+}
+
+void removeSeam(Frame<RgbPixel>& frame, const Seam& seam,
+                vector<RgbPixel>& removed) {
+  do_removeSeam(frame, seam, &removed);
+}
+
+void insertSeam(Frame<PixelValue>& frame, const Seam& seam,
+                const vector<PixelValue>& removed) {
+  do_insertSeam(frame, seam, removed);
+}
+
+void insertSeam(Frame<RgbPixel>& frame, const Seam& seam,
+                const vector<RgbPixel>& removed) {
+  do_insertSeam(frame, seam, removed);
+}
+
+void retargetFrame(const Frame<PixelValue>& from, Frame<PixelValue>& to,
+                   const vector<unsigned>& order,
+                   FlowDirection direction, unsigned count) {
+  do_retargetFrame(from, to, order, direction, count);
+}
+
+void retargetFrame(const Frame<RgbPixel>& from, Frame<RgbPixel>& to,
+                   const vector<unsigned>& order,
+                   FlowDirection direction, unsigned count) {
+  do_retargetFrame(from, to, order, direction, count);
+}
+
+unsigned long getSeamCost(const Frame<PixelValue>& energy,
+                          const Seam& seam) {
+  const vector<size_t>& pos = seam.positions;
+  unsigned long cost = 0;
+  for (size_t i = 0; i < pos.size(); i++) {
+    cost += 1 + ((seam.direction == FLOW_LEFT_RIGHT) ?
+                 energy.values[pos[i] + i * energy.stride] :
+                 energy.values[i + pos[i] * energy.stride]);
+  }
+  return cost;
+}
+
+void transposeFrame(const Frame<PixelValue>& from, Frame<PixelValue>& to) {
+  do_transposeFrame(from, to);
+}
+
+void transposeFrame(const Frame<RgbPixel>& from, Frame<RgbPixel>& to) {
+  do_transposeFrame(from, to);
+}
+
+void drawSeam(const Seam& seam, Frame<PixelValue>& mask) {
+  do_drawSeam(seam, mask);
+}
+
+void drawSeam(const Seam& seam, Frame<RgbPixel>& mask) {
+  do_drawSeam(seam, mask);
+}
+
+void drawSeam(const Seam& seam, FrameWrapper& mask) {
+  if (mask.color) {
+    drawSeam(seam, mask.colorFrame);
+  } else {
+    drawSeam(seam, mask.greyFrame);
+  }
+}
+
+void shrinkFrame(const Frame<RgbPixel>& from, Frame<RgbPixel>& to,
+                 size_t factor) {
+  TraceScope trace("shrinkFrame");
+  to = Frame<RgbPixel>((from.w + factor - 1) / factor,
+                       (from.h + factor - 1) / factor);
+  // channel sums of one row of to, gathered a row of from at a time
+  vector<unsigned long> sums(3 * to.w);
+  for (size_t ty = 0; ty < to.h; ty++) {
+    fill(sums.begin(), sums.end(), 0);
+    size_t rows = min(factor, from.h - ty * factor);
+    for (size_t y = ty * factor; y < ty * factor + rows; y++) {
+      const RgbPixel* row = &from.values[y * from.stride];
+      for (size_t x = 0; x < from.w; x++) {
+        unsigned long* sum = &sums[3 * (x / factor)];
+        sum[0] += row[x].r;
+        sum[1] += row[x].g;
+        sum[2] += row[x].b;
+      }
+    }
+    for (size_t tx = 0; tx < to.w; tx++) {
+      unsigned long n = rows * min(factor, from.w - tx * factor);
+      RgbPixel& p = to.values[tx + ty * to.stride];
+      p.r = sums[3 * tx] / n;
+      p.g = sums[3 * tx + 1] / n;
+      p.b = sums[3 * tx + 2] / n;
+    }
+  }
+}
+
+Frame<RgbPixel>* getRgb(const FrameWrapper& frame) {
+  Frame<RgbPixel>* result;
+  if (frame.color) {
+    result = new Frame<RgbPixel>(frame.colorFrame);
   } else {
-    togglePixel(*frame.greyFrame, x, y);
+    const Frame<PixelValue>& f = frame.greyFrame;
+    result = new Frame<RgbPixel>(f.w, f.h);
+    for (size_t y = 0; y < f.h; y++) {
+      for (size_t x = 0; x < f.w; x++) {
+        RgbPixel& p = result->values[x + y * result->stride];
+        p.r = p.g = p.b = f.values[x + y * f.stride];
+      }
+    }
+  }
+  return result;
+}
+
+Frame<RgbPixel>* getRgb(FrameWrapper&& frame) {
+  if (frame.color) {
+    return new Frame<RgbPixel>(move(frame.colorFrame));
   }
+  return getRgb(frame);
 }
@@ -22,12 +22,26 @@
 #ifndef _DIFF_H
 #define _DIFF_H
 
+#include <vector>
+#include <istream>
+#include <string>
+
 #include "frame.h"
+#include "seam.h"
 
 Frame<PixelValue>* getDifferential(const Frame<PixelValue>& frame);
 Frame<PixelValue>* getDifferential(const Frame<RgbPixel>& frame);
 Frame<PixelValue>* getDifferential(const FrameWrapper& frame);
 
+/* As loadPnm, also giving what getDifferential would. The energy of a
+   row is taken as soon as the row below it is in, while both are still
+   in cache, rather than in a second pass over the whole frame. */
+bool loadPnmDifferential(std::istream& is, FrameWrapper& frame,
+                         Frame<PixelValue>& energy);
+// As readPnm; QOI images still get their energy in a second pass
+bool readPnmDifferential(std::string name, FrameWrapper& frame,
+                         Frame<PixelValue>& energy);
+
 void zeroFrame(Frame<PixelValue>& frame);
 void zeroFrame(Frame<RgbPixel>& frame);
 void zeroFrame(FrameWrapper& frame);
@@ -36,4 +50,63 @@ void togglePixel(Frame<PixelValue>& frame, std::size_t x, std::size_t y);
 void togglePixel(Frame<RgbPixel>& frame, std::size_t x, std::size_t y);
 void togglePixel(FrameWrapper& frame, std::size_t x, std::size_t y);
 
+/* copy from into to, leaving out the pixels on seam. to must already have
+   the reduced size. */
+void removeSeam(const Frame<PixelValue>& from, Frame<PixelValue>& to,
+                const Seam& seam);
+void removeSeam(const Frame<RgbPixel>& from, Frame<RgbPixel>& to,
+                const Seam& seam);
+
+/* remove seam in place. The stride is kept, so only the pixels after the
+   seam move and values is never reallocated. */
+void removeSeam(Frame<PixelValue>& frame, const Seam& seam);
+void removeSeam(Frame<RgbPixel>& frame, const Seam& seam);
+// As above, also storing the removed pixels in removed, in seam order
+void removeSeam(Frame<PixelValue>& frame, const Seam& seam,
+                std::vector<PixelValue>& removed);
+void removeSeam(Frame<RgbPixel>& frame, const Seam& seam,
+                std::vector<RgbPixel>& removed);
+
+/* undoes removeSeam in place, putting back the pixels it removed. The
+   frame must still have the stride and values it had before. */
+void insertSeam(Frame<PixelValue>& frame, const Seam& seam,
+                const std::vector<PixelValue>& removed);
+void insertSeam(Frame<RgbPixel>& frame, const Seam& seam,
+                const std::vector<RgbPixel>& removed);
+
+/* to becomes from without the pixels whose order, indexed x + y * from.w,
+   is below count, all in one pass. They must be count whole seams in
+   direction. to may be from, else it needs room for all of from. */
+void retargetFrame(const Frame<PixelValue>& from, Frame<PixelValue>& to,
+                   const std::vector<unsigned>& order,
+                   FlowDirection direction, unsigned count);
+void retargetFrame(const Frame<RgbPixel>& from, Frame<RgbPixel>& to,
+                   const std::vector<unsigned>& order,
+                   FlowDirection direction, unsigned count);
+
+// Seam::cost of seam in energy, the frame it is cut from
+unsigned long getSeamCost(const Frame<PixelValue>& energy, const Seam& seam);
+
+/* debug mask of seam: mask has the size of the frame the seam was cut
+   from, and the pixels that the cut frame keeps are toggled. */
+void drawSeam(const Seam& seam, Frame<PixelValue>& mask);
+void drawSeam(const Seam& seam, Frame<RgbPixel>& mask);
+void drawSeam(const Seam& seam, FrameWrapper& mask);
+
+/* to becomes from flipped over its diagonal, so the columns of from are
+   the rows of to. Copies square tiles, so that neither frame is walked a
+   whole row apart. to must not be from. */
+void transposeFrame(const Frame<PixelValue>& from, Frame<PixelValue>& to);
+void transposeFrame(const Frame<RgbPixel>& from, Frame<RgbPixel>& to);
+
+/* to becomes from shrunk factor times each way. Every pixel is the mean
+   of the pixels it covers; those on the right and bottom edge may cover
+   fewer. */
+void shrinkFrame(const Frame<RgbPixel>& from, Frame<RgbPixel>& to,
+                 std::size_t factor);
+
+Frame<RgbPixel>* getRgb(const FrameWrapper& frame);
+// Takes the pixels of a color frame rather than copying them
+Frame<RgbPixel>* getRgb(FrameWrapper&& frame);
+
 #endif
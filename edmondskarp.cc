@@ -22,15 +22,17 @@
 #include "edmondskarp.h"
 
 #include "const.h"
+#include "trace.h"
 
 using namespace std;
 
 // faster than list
-typedef deque<Point*> Path;
+typedef deque<Point*, CountingAllocator<Point*, MEMORY_PATHS> > Path;
 
 static void addActive(EdmondsKarpFlowState& state, Point* p) {
   p->active = true;
   state.A.push(p);
+  addWork(state, *p, WORK_ACTIVATED);
 }
 
 static Point* getActive(EdmondsKarpFlowState& state) {
@@ -51,6 +53,7 @@ static void removeActive(EdmondsKarpFlowState& state, Point* p) {
 static void addOrphan(EdmondsKarpFlowState& state, Point* p) {
   p->parent = NULL;
   state.O.push(p);
+  addWork(state, *p, WORK_ORPHANED);
 }
 
 static Point* getOrphan(EdmondsKarpFlowState& state) {
@@ -59,16 +62,20 @@ static Point* getOrphan(EdmondsKarpFlowState& state) {
   return result;
 }
 
-/* Returns > 0 if from is a valid parent of to */
+/* Returns > 0 if from is a valid parent of to: the edge between them has
+   at least delta left */
 template <Point::Tree T>
-static FlowState::EnergyType tree_cap(const Point& from, const Point& to) {
+static FlowState::EnergyType tree_cap(const Point& from, const Point& to,
+                                      FlowState::EnergyType delta) {
+  FlowState::EnergyType left;
   if (T == Point::TREE_S && from.next == &to) {
-    return from.capacity - from.flow;
+    left = from.capacity - from.flow;
   } else if (T == Point::TREE_T && to.next == &from) {
-    return to.capacity - to.flow;
+    left = to.capacity - to.flow;
   } else {
     return (FlowState::EnergyType)1;
   }
+  return (left >= delta) ? left : 0;
 }
 
 static bool is_closer(const Point& p, const Point& q) {
@@ -118,7 +125,7 @@ static void do_adoption(EdmondsKarpFlowState& state, Point& p) {
   for(Point::NeighborSet::iterator i = parents.begin();
       i != parents.end(); ++i) {
     Point &x = **i;
-    if (x.tree == T && tree_cap<T>(x, p)) {
+    if (x.tree == T && tree_cap<T>(x, p, state.delta)) {
       EdmondsKarpFlowState::DistType t = getOrigin(state, x);
       if (t != (EdmondsKarpFlowState::DistType)~0 && t < dist) {
         parent = &x;
@@ -145,7 +152,7 @@ static void do_adoption(EdmondsKarpFlowState& state, Point& p) {
     for (Point::NeighborSet::iterator i = parents.begin();
          i != parents.end(); ++i) {
       Point& x = **i;
-      if (x.tree == T && tree_cap<T>(x, p)) {
+      if (x.tree == T && tree_cap<T>(x, p, state.delta)) {
         addActive(state, &x);
       }
     }
@@ -157,6 +164,7 @@ static void do_adoption(EdmondsKarpFlowState& state, Point& p) {
 static void adopt(EdmondsKarpFlowState& state) {
   if (!state.O.empty()) {
     Point& p = *getOrphan(state);
+    addWork(state, p, WORK_ADOPTIONS);
 
     if (p.tree == Point::TREE_S) {
       do_adoption<Point::TREE_S>(state, p);
@@ -182,11 +190,12 @@ static void augment(EdmondsKarpFlowState& state, Path& P) {
   for (Path::iterator j = P.begin(), i = j++; j != P.end(); ++i, ++j) {
     Point& x = **i;
     Point& y = **j;
+    addWork(state, x, WORK_PATHS);
     if (i == P.begin()) {
       x.flow += bottleneck;
     } else if (x.next == &y) {
       x.flow += bottleneck;
-      if(x.flow >= x.capacity && x.tree == y.tree) {
+      if(x.capacity - x.flow < state.delta && x.tree == y.tree) {
         if (x.tree == Point::TREE_S) {
           addOrphan(state, &y);
         } else { // implied x.tree == Point::TREE_T
@@ -216,7 +225,7 @@ static Path* do_grow(EdmondsKarpFlowState& state, Point& p) {
   for (Point::NeighborSet::iterator i = children.begin();
        i != children.end(); ++i) {
     Point& x = **i;
-    if (tree_cap<T>(p, x) == 0) {
+    if (tree_cap<T>(p, x, state.delta) == 0) {
       continue;
     }
     switch(x.tree) {
@@ -259,7 +268,14 @@ static Path* grow(EdmondsKarpFlowState& state) {
 }
 
 FlowState::EnergyType EdmondsKarpFlowState::calcMaxFlow(FlowDirection direction) {
+  if (!startWithinBudget(direction)) return 0;
+  prepare(direction);
+  return solve();
+}
+
+void EdmondsKarpFlowState::prepare(FlowDirection direction) {
   this->direction = direction;
+  approximate = false;
 
   A = ActiveSet();
   O = OrphanSet();
@@ -274,38 +290,102 @@ FlowState::EnergyType EdmondsKarpFlowState::calcMaxFlow(FlowDirection direction)
 
   time = s.time = t.time = 1;
 
-  points.clear();
-  points.resize(energy->h * energy->w);
+  {
+    TraceScope trace("points.resize");
+    points.clear();
+    points.resize(getNumPoints(*this));
+    resetWork();
+  }
 
+  TraceScope trace("buildGraph");
   if (direction == FLOW_LEFT_RIGHT) {
     buildGraph<FLOW_LEFT_RIGHT>(*this);
   } else {
     buildGraph<FLOW_TOP_BOTTOM>(*this);
   }
+}
+
+// Largest power of two no larger than any capacity
+static FlowState::EnergyType getInitialDelta(
+    const EdmondsKarpFlowState& state) {
+  FlowState::EnergyType most = 1;
+  for (EdmondsKarpFlowState::PointsSet::const_iterator i =
+         state.points.begin(); i != state.points.end(); ++i) {
+    if (i->capacity > most) most = i->capacity;
+  }
+  FlowState::EnergyType delta = 1;
+  while (delta <= most / 2) delta *= 2;
+  return delta;
+}
+
+/* Once delta is lowered every tree node may have edges it could not use
+   before. The trees themselves stay valid. */
+static void activateTrees(EdmondsKarpFlowState& state) {
+  addActive(state, &state.s);
+  addActive(state, &state.t);
+  for (EdmondsKarpFlowState::PointsSet::iterator i = state.points.begin();
+       i != state.points.end(); ++i) {
+    if (i->tree != Point::TREE_NONE) {
+      addActive(state, &*i);
+    }
+  }
+}
+
+FlowState::EnergyType EdmondsKarpFlowState::solve() {
+  TraceScope trace("solve");
+  TraceCounter growing, augmenting, adopting;
+  long paths = 0;
+
+  delta = scaling ? getInitialDelta(*this) : 1;
+  phasePaths.clear();
 
   addActive(*this, &s);
   addActive(*this, &t);
 
   while (true) {
-    Path* P = grow(*this);
-    if (P == NULL) {
-      return s.flow;
-    }
-
-    time += 1;
-    // hopefully this should never happen, but if it does...
-    if (time == 0) {
-      for (EdmondsKarpFlowState::PointsSet::iterator i = points.begin();
-           i != points.end(); ++i) {
-        i->time = 0;
-        i->dist = 0;
+    TraceScope phase("phase", "delta", delta);
+    long phaseStart = paths;
+    while (!cancelled) {
+      if (paths % FLOW_CHECK_INTERVAL == 0 && !withinBudget(s.flow)) break;
+      growing.start();
+      Path* P = grow(*this);
+      growing.stop();
+      if (P == NULL) {
+        break;
       }
+      paths++;
+
       time += 1;
+      // hopefully this should never happen, but if it does...
+      if (time == 0) {
+        for (EdmondsKarpFlowState::PointsSet::iterator i = points.begin();
+             i != points.end(); ++i) {
+          i->time = 0;
+          i->dist = 0;
+        }
+        time += 1;
+      }
+      s.time = t.time = time;
+
+      augmenting.start();
+      augment(*this, *P);
+      delete P;
+      augmenting.stop();
+      adopting.start();
+      adopt(*this);
+      adopting.stop();
     }
-    s.time = t.time = time;
+    phasePaths.push_back(paths - phaseStart);
+    phase.addArg("paths", paths - phaseStart);
 
-    augment(*this, *P);
-    delete P;
-    adopt(*this);
+    if (delta == 1 || cancelled || approximate) break;
+    delta /= 2;
+    activateTrees(*this);
   }
+
+  trace.addArg("paths", paths);
+  trace.addArg("grow_us", growing.micros());
+  trace.addArg("augment_us", augmenting.micros());
+  trace.addArg("adopt_us", adopting.micros());
+  return s.flow;
 }
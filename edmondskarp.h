@@ -25,6 +25,7 @@
 #include <deque>
 #include <queue>
 #include <stack>
+#include <vector>
 
 #include "energy.h"
 
@@ -32,21 +33,38 @@ class EdmondsKarpFlowState : public FlowState {
 public:
   // operations: add, remove something deque clearly faster
   // queue much faster than stack (algorithmically)
-  typedef std::queue<Point*, std::deque<Point*> > ActiveSet;
+  typedef std::deque<Point*, CountingAllocator<Point*, MEMORY_QUEUES> >
+    QueueSet;
+  typedef std::queue<Point*, QueueSet> ActiveSet;
   // operators: add, remove something deque clearly faster than list
   // potential (small) speedup from using a vector with a large reserved size.
-  typedef std::stack<Point*, std::deque<Point*> > OrphanSet;
+  typedef std::stack<Point*, QueueSet> OrphanSet;
 
   TimeType time;
 
   ActiveSet A;
   OrphanSet O;
 
-  EdmondsKarpFlowState(FrameWrapper& frame) :
-    FlowState(frame) { }
+  /* Capacity scaling: solve first with only the edges that have at least
+     delta left, then halve delta down to 1. Fewer, fatter augmenting
+     paths; the trees are kept between phases. */
+  bool scaling;
+  EnergyType delta;
+  // augmenting paths of each phase of the last solve, largest delta first
+  std::vector<long> phasePaths;
+
+  EdmondsKarpFlowState(const FrameWrapper& frame) :
+    FlowState(frame), scaling(EDMONDS_KARP_CAPACITY_SCALING), delta(1) { }
+  EdmondsKarpFlowState(Frame<PixelValue>* energy) :
+    FlowState(energy), scaling(EDMONDS_KARP_CAPACITY_SCALING), delta(1) { }
 
   virtual EnergyType calcMaxFlow(FlowDirection direction);
 
+  /* calcMaxFlow in two steps. Flow put on points (and s.flow) after
+     prepare is kept, and solve only adds to it. */
+  void prepare(FlowDirection direction);
+  EnergyType solve();
+
   virtual ~EdmondsKarpFlowState() { }
 };
 
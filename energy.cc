@@ -21,78 +21,343 @@
  */
 #include "energy.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "edmondskarp.h"
 #include "pushrelabel.h"
+#include "ibfs.h"
+#include "region.h"
+#include "costmodel.h"
+#include "trace.h"
 
 using namespace std;
 
-FlowState* getNewFlowState(FrameWrapper& frame) {
-  switch (DEFAULT_ALGORITHM) {
+const char* getNodeLayoutName(NodeLayout layout) {
+  switch (layout) {
+  case LAYOUT_ROW_MAJOR:
+    return "row";
+  case LAYOUT_TILED:
+    return "tiled";
+  case LAYOUT_MORTON:
+    return "morton";
+  default:
+    return "unknown";
+  }
+}
+
+bool parseNodeLayout(const string& name, NodeLayout& layout) {
+  const NodeLayout all[] = { LAYOUT_ROW_MAJOR, LAYOUT_TILED, LAYOUT_MORTON };
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+    if (name == getNodeLayoutName(all[i])) {
+      layout = all[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* getWorkCounterName(WorkCounter counter) {
+  switch (counter) {
+  case WORK_ACTIVATED:
+    return "activated";
+  case WORK_ORPHANED:
+    return "orphaned";
+  case WORK_ADOPTIONS:
+    return "adoptions";
+  case WORK_PATHS:
+    return "paths";
+  default:
+    return "unknown";
+  }
+}
+
+bool parseWorkCounter(const string& name, WorkCounter& counter) {
+  for (size_t i = 0; i < NUM_WORK_COUNTERS; i++) {
+    if (name == getWorkCounterName((WorkCounter)i)) {
+      counter = (WorkCounter)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+Footprint predictFootprint(size_t w, size_t h, bool color,
+                           MaxFlowAlogorithm algorithm, NodeLayout layout) {
+  if (algorithm == AUTOMATIC) {
+    // any of them may be picked
+    const MaxFlowAlogorithm all[] = { EDMONDS_KARP, IBFS, REGION };
+    Footprint f = predictFootprint(w, h, color, all[0], layout);
+    for (size_t i = 1; i < sizeof(all) / sizeof(all[0]); i++) {
+      Footprint g = predictFootprint(w, h, color, all[i], layout);
+      f.totalBytes = 0;
+      for (size_t j = 0; j < NUM_MEMORY_CATEGORIES; j++) {
+        if (g.bytes[j] > f.bytes[j]) f.bytes[j] = g.bytes[j];
+        f.totalBytes += f.bytes[j];
+      }
+    }
+    return f;
+  }
+
+  size_t pixels = w * h;
+  size_t numPoints = pixels;
+  if (layout != LAYOUT_ROW_MAJOR) {
+    size_t tiles = ((w + NODE_TILE - 1) >> NODE_TILE_BITS) *
+                   ((h + NODE_TILE - 1) >> NODE_TILE_BITS);
+    numPoints = tiles << (2 * NODE_TILE_BITS);
+  }
+  // the region solver holds the bands being merged and the merged bands
+  size_t graphs = (algorithm == REGION) ? 2 : 1;
+
+  size_t subject = pixels * (color ? sizeof(RgbPixel) : sizeof(PixelValue));
+  size_t energy = pixels * sizeof(PixelValue);
+  // cutFrame works in place; the region solver copies the energy into
+  // bands twice over while merging
+  Footprint f;
+  f.bytes[MEMORY_FRAMES] = subject + energy + (graphs - 1) * 2 * energy;
+  f.bytes[MEMORY_POINTS] = graphs * numPoints * sizeof(Point);
+  // every node reserves 4 neighbors each way; s and t link a whole side
+  f.bytes[MEMORY_NEIGHBORS] = graphs * (numPoints * 2 * 4 +
+                                        2 * (w > h ? w : h)) * sizeof(Point*);
+  switch (algorithm) {
+  case IBFS:
+    // layers and orphan buckets, with room for vectors to double
+    f.bytes[MEMORY_QUEUES] = 4 * pixels * sizeof(Point*);
+    f.bytes[MEMORY_PATHS] = 0;
+    break;
+  default:
+    // active and orphan queues; one path at a time per band
+    f.bytes[MEMORY_QUEUES] = 2 * pixels * sizeof(Point*);
+    f.bytes[MEMORY_PATHS] = (pixels + 2) * sizeof(Point*);
+    break;
+  }
+  f.totalBytes = 0;
+  for (size_t i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    f.totalBytes += f.bytes[i];
+  }
+  return f;
+}
+
+const char* getAlgorithmName(MaxFlowAlogorithm algorithm) {
+  switch (algorithm) {
   case EDMONDS_KARP:
-    return new EdmondsKarpFlowState(frame);
+    return "ek";
   case PUSH_RELABEL:
-    return new PushRelabelFlowState(frame);
+    return "pr";
+  case IBFS:
+    return "ibfs";
+  case REGION:
+    return "region";
+  case AUTOMATIC:
+    return "auto";
   default:
-    return NULL;
+    return "unknown";
+  }
+}
+
+bool parseAlgorithm(const string& name, MaxFlowAlogorithm& algorithm) {
+  // push relabel is not finished, so it cannot be picked
+  const MaxFlowAlogorithm all[] = { EDMONDS_KARP, IBFS, REGION, AUTOMATIC };
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+    if (name == getAlgorithmName(all[i])) {
+      algorithm = all[i];
+      return true;
+    }
   }
+  return false;
 }
 
-FrameWrapper* FlowState::cutFrame(const FrameWrapper& subject,
-                                  FrameWrapper* cut) {
-  if ((subject.getWidth() != this->energy->w ||
-       subject.getHeight() != this->energy->h) ||
-      (cut != NULL && (cut->getWidth() != subject.getWidth() ||
-                       cut->getHeight() != subject.getHeight()))) {
+FlowState* getNewFlowState(const FrameWrapper& frame) {
+  return getNewFlowState(getDifferential(frame));
+}
+
+FlowState* getNewFlowState(Frame<PixelValue>* energy) {
+  return getNewFlowState(energy, DEFAULT_ALGORITHM);
+}
+
+MaxFlowAlogorithm resolveAlgorithm(MaxFlowAlogorithm algorithm,
+                                   const Frame<PixelValue>& energy,
+                                   double* predicted) {
+  if (predicted != NULL) *predicted = -1;
+  if (algorithm != AUTOMATIC) return algorithm;
+  TraceScope trace("pickAlgorithm");
+  double cost;
+  MaxFlowAlogorithm picked =
+    pickAlgorithm(getCostModel(), getEnergyStats(energy), &cost);
+  if (picked == AUTOMATIC) picked = DEFAULT_ALGORITHM;
+  trace.addArg("algorithm", picked);
+  trace.addArg("predicted_us", (long)cost);
+  if (predicted != NULL) *predicted = cost;
+  return picked;
+}
+
+FlowState* getNewFlowState(Frame<PixelValue>* energy,
+                           MaxFlowAlogorithm algorithm) {
+  switch (algorithm) {
+  case EDMONDS_KARP:
+    return new EdmondsKarpFlowState(energy);
+  case PUSH_RELABEL:
+    return new PushRelabelFlowState(energy);
+  case IBFS:
+    return new IbfsFlowState(energy);
+  case REGION:
+    return new RegionFlowState(energy);
+  case AUTOMATIC:
+    return getNewFlowState(energy, resolveAlgorithm(algorithm, *energy,
+                                                    NULL));
+  default:
+    delete energy;
     return NULL;
   }
+}
 
-  FrameWrapper* result = new FrameWrapper(subject.color);
-  if (direction == FLOW_LEFT_RIGHT) {
-    result->setSize(subject.getWidth()-1, subject.getHeight());
-  } else {
-    result->setSize(subject.getWidth(), subject.getHeight()-1);
-  }
-
-  Frame<PixelValue>* newEnergy = new Frame<PixelValue>(result->getWidth(),
-                                                       result->getHeight());
-
-  if (cut != NULL) {
-    zeroFrame(*cut);
-  }
-
-  for(size_t i = 0; i < points.size(); i++) {
-    std::size_t x = i % subject.getWidth(), y = i / subject.getWidth();
-    std::size_t tox, toy;
-    if (points[i].tree == Point::TREE_T ||
-        points[i].tree == Point::TREE_NONE) {
-      if (direction == FLOW_LEFT_RIGHT && x > 0) {
-        tox = x - 1;
-        toy = y;
-      } else if (direction == FLOW_TOP_BOTTOM && y > 0) {
-        tox = x;
-        toy = y - 1;
-      } else {
-        tox = x;
-        toy = y;
-      }
-    } else {
-      tox = x;
-      toy = y;
-    }
-    if (subject.color) {
-      result->colorFrame->values[tox + toy * result->getWidth()] =
-        subject.colorFrame->values[x + y * subject.getWidth()];
+bool FlowState::withinBudget(EnergyType flow) {
+  if (Clock::now() >= deadline || (progress && !progress(flow))) {
+    approximate = true;
+  }
+  return !approximate;
+}
+
+bool FlowState::startWithinBudget(FlowDirection direction) {
+  this->direction = direction;
+  approximate = false;
+  if (!withinBudget(0)) {
+    s.flow = 0;
+    return false;
+  }
+  return true;
+}
+
+void FlowState::resetWork() {
+  for (size_t i = 0; i < NUM_WORK_COUNTERS; i++) {
+    if (countWork) {
+      work[i].assign(points.size(), 0);
     } else {
-      result->greyFrame->values[tox + toy * result->getWidth()] =
-        subject.greyFrame->values[x + y * subject.getWidth()];
+      WorkSet().swap(work[i]);
     }
-    newEnergy->values[tox + toy * newEnergy->w] =
-      this->energy->values[x + y * this->energy->w];
-    if (cut != NULL) {
-      togglePixel(*cut, tox, toy);
+  }
+}
+
+Frame<RgbPixel>* getWorkHeatmap(const FlowState& state, WorkCounter counter) {
+  const FlowState::WorkSet& work = state.work[counter];
+  if (!state.countWork || work.size() != state.points.size()) return NULL;
+  size_t w = state.energy->w, h = state.energy->h;
+  unsigned most = 0;
+  if (!work.empty()) most = *max_element(work.begin(), work.end());
+  // a few very busy nodes would leave the rest black on a linear scale
+  double scale = (most > 0) ? 3 * 255 / log1p(most) : 0;
+
+  Frame<RgbPixel>* result = new Frame<RgbPixel>(w, h);
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      int v = (int)(log1p(work[getOff(state, x, y)]) * scale + 0.5);
+      RgbPixel& pixel = result->values[x + y * result->stride];
+      pixel.r = (PixelValue)min(v, 255);
+      pixel.g = (PixelValue)max(min(v - 255, 255), 0);
+      pixel.b = (PixelValue)max(min(v - 2 * 255, 255), 0);
     }
   }
-  delete this->energy;
-  this->energy = newEnergy;
   return result;
 }
+
+void FlowState::findApproximateSeam(Seam& seam) const {
+  bool lr = (direction == FLOW_LEFT_RIGHT);
+  size_t length = lr ? energy->h : energy->w;
+  size_t across = lr ? energy->w : energy->h;
+  // cost[i * across + j]: cheapest path to position j of row (or column) i
+  vector<unsigned long> cost(length * across);
+  for (size_t i = 0; i < length; i++) {
+    for (size_t j = 0; j < across; j++) {
+      unsigned long c = 1 + (lr ? energy->values[j + i * energy->stride]
+                                : energy->values[i + j * energy->stride]);
+      if (i > 0) {
+        const unsigned long* prev = &cost[(i - 1) * across];
+        unsigned long best = prev[j];
+        if (j > 0 && prev[j - 1] < best) best = prev[j - 1];
+        if (j + 1 < across && prev[j + 1] < best) best = prev[j + 1];
+        c += best;
+      }
+      cost[i * across + j] = c;
+    }
+  }
+
+  seam.positions.resize(length);
+  const unsigned long* last = &cost[(length - 1) * across];
+  size_t j = min_element(last, last + across) - last;
+  for (size_t i = length - 1; ; i--) {
+    seam.positions[i] = j;
+    if (i == 0) break;
+    const unsigned long* prev = &cost[(i - 1) * across];
+    size_t from = j;
+    if (j > 0 && prev[j - 1] < prev[from]) from = j - 1;
+    if (j + 1 < across && prev[j + 1] < prev[from]) from = j + 1;
+    j = from;
+  }
+}
+
+void FlowState::findSeam(Seam& seam) const {
+  size_t w = energy->w, h = energy->h;
+  seam.direction = direction;
+  seam.approximate = approximate;
+  if (approximate) {
+    findApproximateSeam(seam);
+  } else if (direction == FLOW_LEFT_RIGHT) {
+    // the last S pixel of each row (or column) is the one that is dropped
+    seam.positions.assign(h, w - 1);
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        if (points[getOff(*this, x, y)].tree != Point::TREE_S) {
+          seam.positions[y] = (x > 0) ? x - 1 : 0;
+          break;
+        }
+      }
+    }
+  } else {
+    seam.positions.assign(w, h - 1);
+    vector<bool> found(w, false);
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        if (!found[x] && points[getOff(*this, x, y)].tree != Point::TREE_S) {
+          seam.positions[x] = (y > 0) ? y - 1 : 0;
+          found[x] = true;
+        }
+      }
+    }
+  }
+  // the flow a solver stops at may be short of the cut, so it is not used
+  seam.cost = getSeamCost(*energy, seam);
+}
+
+void FlowState::cutEnergy(Seam& seam, vector<PixelValue>* removed) {
+  findSeam(seam);
+  if (removed != NULL) {
+    removeSeam(*energy, seam, *removed);
+  } else {
+    removeSeam(*energy, seam);
+  }
+}
+
+template<typename T>
+bool FlowState::cutFrame(Frame<T>& subject, Seam* seam) {
+  TraceScope trace("cutFrame");
+  if (subject.w != this->energy->w || subject.h != this->energy->h) {
+    return false;
+  }
+
+  Seam found;
+  if (seam == NULL) seam = &found;
+  cutEnergy(*seam);
+  removeSeam(subject, *seam);
+  return true;
+}
+
+template bool FlowState::cutFrame(Frame<PixelValue>&, Seam*);
+template bool FlowState::cutFrame(Frame<RgbPixel>&, Seam*);
+
+bool FlowState::cutFrame(FrameWrapper& subject, Seam* seam) {
+  if (subject.color) {
+    return cutFrame(subject.colorFrame, seam);
+  } else {
+    return cutFrame(subject.greyFrame, seam);
+  }
+}
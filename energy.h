@@ -23,6 +23,10 @@
 #define _ENERGY_H
 
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
 
 #include "frame.h"
 #include "diff.h"
@@ -33,15 +37,11 @@ typedef unsigned short _FlowStateTimeType;
 
 #include "point.h"
 
-enum FlowDirection {
-  FLOW_LEFT_RIGHT,
-  FLOW_TOP_BOTTOM
-};
-
 class FlowState {
 public:
   // random access required, vector/deque approx same speed.
-  typedef std::vector<Point> PointsSet;
+  typedef std::vector<Point, StorageAllocator<Point, MEMORY_POINTS> >
+    PointsSet;
 
   typedef _FlowStateEnergyType EnergyType;
   typedef _FlowStateDistType DistType;
@@ -49,29 +49,205 @@ public:
 
   PointsSet points;
 
+  typedef std::vector<Point*, StorageAllocator<Point*, MEMORY_NEIGHBORS> >
+    NeighborsSet;
+  /* Point::to and Point::from of every node are runs of this: 4 slots each
+     way per node, then the sides that s and t link to */
+  NeighborsSet neighbors;
+
   Point s;
   Point t;
 
   FlowDirection direction;
+  NodeLayout layout;
   Frame<PixelValue>* energy;
+
+  // May be set from another thread to abort an in-flight calcMaxFlow.
+  // The trees are left half-built, so the result must not be cut.
+  std::atomic<bool> cancelled;
+
+  typedef std::chrono::steady_clock Clock;
+  // Gets the flow so far; returning false stops calcMaxFlow like deadline
+  typedef std::function<bool(EnergyType)> ProgressCallback;
+
+  // calcMaxFlow stops at this time; Clock::time_point::max() for never
+  Clock::time_point deadline;
+  // Called every FLOW_CHECK_INTERVAL steps of calcMaxFlow; may be empty
+  ProgressCallback progress;
+  /* Set by calcMaxFlow when it stopped for deadline or progress. The flow
+     it returned is then only a lower bound, and findSeam falls back to a
+     seam found by dynamic programming on energy. */
+  bool approximate;
+
+  typedef std::vector<unsigned> WorkSet;
+  /* Set to have calcMaxFlow count the work it does per node in work,
+     indexed like points. Costs a little time, so it is off by default. */
+  bool countWork;
+  WorkSet work[NUM_WORK_COUNTERS];
 protected:
-  FlowState(FrameWrapper& frame) :
-    energy(getDifferential(frame)) { }
+  FlowState(const FrameWrapper& frame) : layout(DEFAULT_NODE_LAYOUT),
+    energy(getDifferential(frame)), cancelled(false),
+    deadline(Clock::time_point::max()), approximate(false),
+    countWork(false) { }
+  // takes ownership of energy
+  FlowState(Frame<PixelValue>* energy) : layout(DEFAULT_NODE_LAYOUT),
+    energy(energy), cancelled(false), deadline(Clock::time_point::max()),
+    approximate(false), countWork(false) { }
+
+  // For calcMaxFlow, once points is sized: zeroes work, or frees it
+  void resetWork();
+
+  // Cheapest connected seam by dynamic programming, ignoring the flow
+  void findApproximateSeam(Seam& seam) const;
 public:
+  /* For the solvers, every FLOW_CHECK_INTERVAL steps. Returns false, and
+     marks the state approximate, once calcMaxFlow has to stop. */
+  bool withinBudget(EnergyType flow);
+
+  /* For the start of calcMaxFlow: sets direction, and returns false with
+     the state approximate and no flow if the budget is already gone, so
+     that no graph need be built for findSeam to fall back */
+  bool startWithinBudget(FlowDirection direction);
+
   virtual EnergyType calcMaxFlow(FlowDirection direction) = 0;
 
-  virtual FrameWrapper* cutFrame(const FrameWrapper& subject,
-                                 FrameWrapper* cut);
+  virtual void cancel() {
+    cancelled = true;
+  }
+
+  // Seam along the S/T boundary left by the last calcMaxFlow
+  virtual void findSeam(Seam& seam) const;
+
+  /* Removes the seam of the last calcMaxFlow from subject and energy in
+     place, and stores it in seam unless that is NULL. Returns false,
+     leaving both alone, if subject is not the size of energy. */
+  // Branches on the pixel type once and forwards to the template below
+  virtual bool cutFrame(FrameWrapper& subject, Seam* seam = NULL);
+
+  // Instantiated for PixelValue and RgbPixel in energy.cc
+  template<typename T>
+  bool cutFrame(Frame<T>& subject, Seam* seam = NULL);
+
+  /* As cutFrame, for callers that keep the image themselves. The energy
+     removed is stored in removed unless that is NULL. */
+  void cutEnergy(Seam& seam, std::vector<PixelValue>* removed = NULL);
 
   virtual ~FlowState() {
     delete energy;
   }
 };
 
-FlowState* getNewFlowState(FrameWrapper& frame);
+FlowState* getNewFlowState(const FrameWrapper& frame);
+/* AUTOMATIC is picked by the cost model for energy, and the pick traced;
+   other algorithms are returned as they are. predicted, which may be NULL,
+   gets the microseconds per max flow the model expects of the result, or
+   -1 if the model was not asked or has no coefficients. */
+MaxFlowAlogorithm resolveAlgorithm(MaxFlowAlogorithm algorithm,
+                                   const Frame<PixelValue>& energy,
+                                   double* predicted);
+
+// takes ownership of energy
+FlowState* getNewFlowState(Frame<PixelValue>* energy);
+FlowState* getNewFlowState(Frame<PixelValue>* energy,
+                           MaxFlowAlogorithm algorithm);
+
+/* Peak bytes of carving a w x h image, per MemoryCategory as counted by
+   getMemoryUsage. Queues and paths depend on the image, so for them this
+   is an upper bound. */
+struct Footprint {
+  std::size_t bytes[NUM_MEMORY_CATEGORIES];
+  std::size_t totalBytes;
+};
+
+Footprint predictFootprint(std::size_t w, std::size_t h, bool color,
+                           MaxFlowAlogorithm algorithm, NodeLayout layout);
+
+const char* getAlgorithmName(MaxFlowAlogorithm algorithm);
+bool parseAlgorithm(const std::string& name, MaxFlowAlogorithm& algorithm);
 
+const char* getNodeLayoutName(NodeLayout layout);
+bool parseNodeLayout(const std::string& name, NodeLayout& layout);
+
+const char* getWorkCounterName(WorkCounter counter);
+bool parseWorkCounter(const std::string& name, WorkCounter& counter);
+
+/* counter of the last calcMaxFlow per pixel, from black through red and
+   yellow to white on a log scale. NULL unless state.countWork was set. */
+Frame<RgbPixel>* getWorkHeatmap(const FlowState& state, WorkCounter counter);
+
+#define NODE_TILE (1 << NODE_TILE_BITS)
+
+// interleaves the low 8 bits of v with zeros
+inline size_t spreadBits(size_t v) {
+  v = (v | (v << 4)) & 0x0F0F;
+  v = (v | (v << 2)) & 0x3333;
+  v = (v | (v << 1)) & 0x5555;
+  return v;
+}
+
+inline size_t compactBits(size_t v) {
+  v &= 0x5555;
+  v = (v | (v >> 1)) & 0x3333;
+  v = (v | (v >> 2)) & 0x0F0F;
+  v = (v | (v >> 4)) & 0x00FF;
+  return v;
+}
+
+inline size_t getTilesPerRow(const FlowState& state) {
+  return (state.energy->w + NODE_TILE - 1) >> NODE_TILE_BITS;
+}
+
+// Size of points, including the padding of partial tiles
+inline size_t getNumPoints(const FlowState& state) {
+  if (state.layout == LAYOUT_ROW_MAJOR) {
+    return state.energy->w * state.energy->h;
+  }
+  size_t rows = (state.energy->h + NODE_TILE - 1) >> NODE_TILE_BITS;
+  return (getTilesPerRow(state) * rows) << (2 * NODE_TILE_BITS);
+}
+
+/* index into points of the node for pixel (x, y). Tiled layouts keep
+   the vertical and diagonal neighbors that grow and adopt visit close
+   by, where row-major puts them a whole row apart. */
 inline size_t getOff(const FlowState& state, size_t x, size_t y) {
-  return y * state.energy->w + x;
+  if (state.layout == LAYOUT_ROW_MAJOR) {
+    return y * state.energy->w + x;
+  }
+  size_t tile = (y >> NODE_TILE_BITS) * getTilesPerRow(state) +
+                (x >> NODE_TILE_BITS);
+  size_t ix = x & (NODE_TILE - 1), iy = y & (NODE_TILE - 1);
+  size_t inner = (state.layout == LAYOUT_TILED) ?
+                 (iy << NODE_TILE_BITS) | ix :
+                 spreadBits(ix) | (spreadBits(iy) << 1);
+  return (tile << (2 * NODE_TILE_BITS)) | inner;
+}
+
+// inverse of getOff; padding nodes map outside the energy frame
+inline void getCoords(const FlowState& state, size_t o,
+                      size_t& x, size_t& y) {
+  if (state.layout == LAYOUT_ROW_MAJOR) {
+    x = o % state.energy->w;
+    y = o / state.energy->w;
+    return;
+  }
+  size_t tile = o >> (2 * NODE_TILE_BITS);
+  size_t inner = o & ((1 << (2 * NODE_TILE_BITS)) - 1);
+  size_t ix, iy;
+  if (state.layout == LAYOUT_TILED) {
+    ix = inner & (NODE_TILE - 1);
+    iy = inner >> NODE_TILE_BITS;
+  } else {
+    ix = compactBits(inner);
+    iy = compactBits(inner >> 1);
+  }
+  x = ((tile % getTilesPerRow(state)) << NODE_TILE_BITS) + ix;
+  y = ((tile / getTilesPerRow(state)) << NODE_TILE_BITS) + iy;
+}
+
+// For the solvers; s and t are not counted
+inline void addWork(FlowState& state, const Point& p, WorkCounter counter) {
+  if (!state.countWork || &p == &state.s || &p == &state.t) return;
+  state.work[counter][&p - &state.points[0]]++;
 }
 
 /* if into return nodes p flows into, else return nodes that flow into p
@@ -82,8 +258,10 @@ void populateNeighbors(Point& p, FlowState& state,
   Point::NeighborSet& result = (into?p.to:p.from);
   size_t w = state.energy->w;
   size_t h = state.energy->h;
+  size_t nodes = state.points.size();
   if (&p != &state.s && &p != &state.t) {
-    result.reserve(4);
+    result.start(&state.neighbors[(&p - &state.points[0]) * 8 +
+                                  (into ? 0 : 4)]);
     if (direction == FLOW_LEFT_RIGHT) {
       if (x < w-1) {
         size_t o = getOff(state, x+1, y);
@@ -132,28 +310,27 @@ void populateNeighbors(Point& p, FlowState& state,
       result.push_back(&state.points[o]);
     }
   } else if (&p == &state.s && into) {
+    result.start(&state.neighbors[nodes * 8]);
     if (direction == FLOW_LEFT_RIGHT) {
-      result.reserve(h);
       for(size_t i = 0; i < h; i++) {
         size_t o = getOff(state, 0, i);
         result.push_back(&state.points[o]);
       }
     } else {
-      result.reserve(w);
       for(size_t i = 0; i < w; i++) {
         size_t o = getOff(state, i, 0);
         result.push_back(&state.points[o]);
       }
     }
   } else if (&p == &state.t && !into) {
+    result.start(&state.neighbors[nodes * 8 +
+                                  (direction == FLOW_LEFT_RIGHT ? h : w)]);
     if (direction == FLOW_LEFT_RIGHT) {
-      result.reserve(h);
       for(size_t i = 0; i < h; i++) {
         size_t o = getOff(state, w-1, i);
         result.push_back(&state.points[o]);
       }
     } else {
-      result.reserve(w);
       for(size_t i = 0; i < w; i++) {
         size_t o = getOff(state, i, h-1);
         result.push_back(&state.points[o]);
@@ -165,16 +342,25 @@ void populateNeighbors(Point& p, FlowState& state,
 template<FlowDirection direction>
 void buildGraph(FlowState& state) {
   const Frame<PixelValue>& frame = *state.energy;
-  for(size_t y = 0; y < frame.h; y++) {
-    for(size_t x = 0; x < frame.w; x++) {
-      size_t o = getOff(state, x, y);
-      Point& p = state.points[o];
-      p.capacity = frame.values[o] + 1;
-      p.flow = 0;
-      populateNeighbors<true, direction>(p, state, x, y);
-      if (p.to.front() != &state.t)
-        p.next = p.to.front();
-      populateNeighbors<false, direction>(p, state, x, y);
+  // visit tiles in storage order; a row-major tile is the whole frame
+  size_t tw = (state.layout == LAYOUT_ROW_MAJOR) ? frame.w : NODE_TILE;
+  size_t th = (state.layout == LAYOUT_ROW_MAJOR) ? frame.h : NODE_TILE;
+  size_t side = (direction == FLOW_LEFT_RIGHT) ? frame.h : frame.w;
+  state.neighbors.resize(state.points.size() * 8 + 2 * side);
+  for(size_t ty = 0; ty < frame.h; ty += th) {
+    for(size_t tx = 0; tx < frame.w; tx += tw) {
+      for(size_t y = ty; y < frame.h && y < ty + th; y++) {
+        for(size_t x = tx; x < frame.w && x < tx + tw; x++) {
+          size_t o = getOff(state, x, y);
+          Point& p = state.points[o];
+          p.capacity = frame.values[x + y * frame.stride] + 1;
+          p.flow = 0;
+          populateNeighbors<true, direction>(p, state, x, y);
+          if (p.to.front() != &state.t)
+            p.next = p.to.front();
+          populateNeighbors<false, direction>(p, state, x, y);
+        }
+      }
     }
   }
 
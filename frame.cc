@@ -22,27 +22,65 @@
 #include "frame.h"
 
 #include <string>
+#include <algorithm>
 #include <cctype>
-#include <deque>
 #include <fstream>
 
+#include "trace.h"
+
 using namespace std;
 
-FrameWrapper* loadPnm(istream& is) {
+bool loadPnm(istream& is, FrameWrapper& frame) {
   string magic = getMagic(is);
-  FrameWrapper* result = new FrameWrapper;
   if (magic == "P2" || magic == "P5") {
-    result->color = false;
-    result->greyFrame = loadPgm(is);
-    if (result->greyFrame == NULL) return NULL;
+    Frame<PixelValue> grey;
+    if (!loadPgm(is, grey)) return false;
+    frame = FrameWrapper(move(grey));
   } else if (magic == "P3" || magic == "P6") {
-    result->color = true;
-    result->colorFrame = loadPpm(is);
-    if (result->colorFrame == NULL) return NULL;
+    Frame<RgbPixel> color;
+    if (!loadPpm(is, color)) return false;
+    frame = FrameWrapper(move(color));
   } else {
-    return NULL;
+    return false;
   }
-  return result;
+  return true;
+}
+
+static inline void fromSamples(const unsigned char* in,
+                               const PixelValue* scale, PixelValue& p) {
+  p = scale[in[0]];
+}
+
+static inline void fromSamples(const unsigned char* in,
+                               const PixelValue* scale, RgbPixel& p) {
+  p.r = scale[in[0]];
+  p.g = scale[in[1]];
+  p.b = scale[in[2]];
+}
+
+/* The rest of a binary raster, read a row at a time rather than a byte.
+   False if it is short, or longer by a whole pixel. */
+template<typename T>
+static bool loadRaster(istream& is, Frame<T>& r, int max, size_t samples,
+                       const function<void(const Frame<T>&, size_t)>& rows) {
+  // samples are bytes, so every value they scale to can be looked up
+  PixelValue scale[256];
+  for (int i = 0; i < 256; i++) {
+    scale[i] = i * 0xFF / max;
+  }
+  vector<unsigned char> buf(r.w * samples);
+  for (size_t y = 0; y < r.h; y++) {
+    is.read(reinterpret_cast<char*>(buf.data()), buf.size());
+    if ((size_t)is.gcount() != buf.size()) return false;
+    r.values.resize((y + 1) * r.w);
+    T* out = &r.values[y * r.w];
+    for (size_t x = 0; x < r.w; x++) {
+      fromSamples(&buf[x * samples], scale, out[x]);
+    }
+    if (rows) rows(r, y + 1);
+  }
+  is.read(reinterpret_cast<char*>(buf.data()), min(samples, buf.size()));
+  return (size_t)is.gcount() < samples;
 }
 
 string getMagic(std::istream& is) {
@@ -55,11 +93,9 @@ string getMagic(std::istream& is) {
   return res;
 }
 
-Frame<PixelValue>* loadPgm(std::istream& is) {
-  Frame<PixelValue>* r = new Frame<PixelValue>();
-
-  r->w = 0;
-  r->h = 0;
+bool loadPgm(std::istream& is, Frame<PixelValue>& frame,
+             const PgmRowsCallback& rows) {
+  Frame<PixelValue> r;
 
   int max = -1;
 
@@ -72,7 +108,7 @@ Frame<PixelValue>* loadPgm(std::istream& is) {
   } else if (line == "P2") {
     binary = false;
   } else {
-    return NULL;
+    return false;
   }
   bool comment = false;
   bool raster = false;
@@ -80,11 +116,8 @@ Frame<PixelValue>* loadPgm(std::istream& is) {
     int c = is.peek();
     if (is.eof()) break;
     if (binary && raster) {
-      r->values.push_back(is.get() * 0xFF / max);
-      if (r->values.size() > r->w * r->h) {
-        delete r;
-        return NULL;
-      }
+      if (!loadRaster(is, r, max, 1, rows)) return false;
+      break;
     } else if (!comment && c == '#') {
       comment = true;
       is.get();
@@ -94,22 +127,24 @@ Frame<PixelValue>* loadPgm(std::istream& is) {
     } else if (!comment && isdigit(c)) {
       unsigned int v;
       is >> v;
-      if (r->w == 0) {
-        r->w = v;
-      } else if (r->h == 0) {
-        r->h = v;
+      if (r.w == 0) {
+        r.w = r.stride = v;
+      } else if (r.h == 0) {
+        r.h = v;
       } else if (max == -1) {
         max = v;
-        r->values.reserve(r->w * r->h);
+        r.values.reserve(r.w * r.h);
         if (binary) {
           raster = true;
           is.get(); // discard single whitespace before raster
         }
       } else {
-        r->values.push_back(v * 0xFF / max);
-        if (r->values.size() > r->w * r->h) {
-          delete r;
-          return NULL;
+        r.values.push_back(v * 0xFF / max);
+        if (r.values.size() > r.w * r.h) {
+          return false;
+        }
+        if (rows && r.values.size() % r.w == 0) {
+          rows(r, r.values.size() / r.w);
         }
       }
     } else {
@@ -117,15 +152,23 @@ Frame<PixelValue>* loadPgm(std::istream& is) {
     }
   }
 
-  return r;
+  // a short raster would leave the frame without all its pixels
+  if (r.values.size() != r.w * r.h) return false;
+  frame = move(r);
+  return true;
 }
 
-Frame<RgbPixel>* loadPpm(std::istream& is) {
-  Frame<RgbPixel>* r = new Frame<RgbPixel>();
+bool loadPpm(std::istream& is, Frame<RgbPixel>& frame,
+             const PpmRowsCallback& rows) {
+  Frame<RgbPixel> r;
+
+  int max = -1;
 
   string line;
 
-  deque<unsigned int> values;
+  // components of the pixel being read
+  unsigned int values[3];
+  size_t n = 0;
 
   getline(is, line);
   bool binary;
@@ -134,7 +177,7 @@ Frame<RgbPixel>* loadPpm(std::istream& is) {
   } else if (line == "P3") {
     binary = false;
   } else {
-    return NULL;
+    return false;
   }
   bool comment = false;
   bool raster = false;
@@ -142,7 +185,8 @@ Frame<RgbPixel>* loadPpm(std::istream& is) {
     int c = is.peek();
     if (is.eof()) break;
     if (binary && raster) {
-      values.push_back(is.get());
+      if (!loadRaster(is, r, max, 3, rows)) return false;
+      break;
     } else if (!comment && c == '#') {
       comment = true;
       is.get();
@@ -152,35 +196,43 @@ Frame<RgbPixel>* loadPpm(std::istream& is) {
     } else if (!comment && isdigit(c)) {
       unsigned int v;
       is >> v;
-      values.push_back(v);
-      if (binary && values.size() == 3) {
-        raster = true;
-        is.get(); // discard 1xwhitespace value
+      if (r.w == 0) {
+        r.w = r.stride = v;
+      } else if (r.h == 0) {
+        r.h = v;
+      } else if (max == -1) {
+        max = v;
+        r.values.reserve(r.w * r.h);
+        if (binary) {
+          raster = true;
+          is.get(); // discard 1xwhitespace value
+        }
+      } else {
+        values[n++] = v;
       }
     } else {
       is.get();
     }
+    if (n == 3) {
+      RgbPixel p;
+      p.r = values[0] * 0xFF/max;
+      p.g = values[1] * 0xFF/max;
+      p.b = values[2] * 0xFF/max;
+      r.values.push_back(p);
+      n = 0;
+      if (r.values.size() > r.w * r.h) {
+        return false;
+      }
+      if (rows && r.values.size() % r.w == 0) {
+        rows(r, r.values.size() / r.w);
+      }
+    }
   }
 
-  r->w = values.front();
-  values.pop_front();
-  r->h = values.front();
-  values.pop_front();
-  int max = values.front();
-  values.pop_front();
-  r->values.reserve(r->w * r->h);
-  while (values.size()) {
-    RgbPixel p;
-    p.r = values.front() * 0xFF/max;
-    values.pop_front();
-    p.g = values.front() * 0xFF/max;
-    values.pop_front();
-    p.b = values.front() * 0xFF/max;
-    values.pop_front();
-    r->values.push_back(p);
-  }
-
-  return r;
+  // a short raster would leave the frame without all its pixels
+  if (r.values.size() != r.w * r.h) return false;
+  frame = move(r);
+  return true;
 }
 
 void printPgm(const Frame<PixelValue>& f, ostream& os, bool binary) {
@@ -188,16 +240,23 @@ void printPgm(const Frame<PixelValue>& f, ostream& os, bool binary) {
   os << f.w << " " << f.h << "\n";
   os << 255 << "\n";
   size_t j = 0;
-  for (Frame<PixelValue>::ValuesSet::const_iterator i = f.values.begin();
-       i != f.values.end(); ++i) {
-    if (!binary) {
-      os << (unsigned int)*i << " ";
-      if (++j == 19) {
-        os << "\n";
-        j = 0;
+  for (size_t y = 0; y < f.h; y++) {
+    Frame<PixelValue>::ValuesSet::const_iterator row =
+      f.values.begin() + y * f.stride;
+    for (Frame<PixelValue>::ValuesSet::const_iterator i = row;
+         i != row + f.w; ++i) {
+      if (!binary) {
+        os << (unsigned int)*i << " ";
+        if (++j == 19) {
+          os << "\n";
+          j = 0;
+        }
+      } else {
+        os << *i;
       }
-    } else {
-      os << *i;
+    }
+    if (y % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+      releaseRows(f, y + 1 - STORAGE_TILE_ROWS, y + 1);
     }
   }
 }
@@ -207,26 +266,33 @@ void printPpm(const Frame<RgbPixel>& f, ostream& os, bool binary) {
   os << f.w << " " << f.h << "\n";
   os << 255 << "\n";
   size_t j = 0;
-  for (Frame<RgbPixel>::ValuesSet::const_iterator i = f.values.begin();
-       i != f.values.end(); ++i) {
-    if (!binary) {
-      os << (unsigned int)(*i).r << " ";
-      if (++j == 19) {
-        os << "\n";
-        j = 0;
-      }
-      os << (unsigned int)(*i).g << " ";
-      if (++j == 19) {
-        os << "\n";
-        j = 0;
-      }
-      os << (unsigned int)(*i).b << " ";
-      if (++j == 19) {
-        os << "\n";
-        j = 0;
+  for (size_t y = 0; y < f.h; y++) {
+    Frame<RgbPixel>::ValuesSet::const_iterator row =
+      f.values.begin() + y * f.stride;
+    for (Frame<RgbPixel>::ValuesSet::const_iterator i = row;
+         i != row + f.w; ++i) {
+      if (!binary) {
+        os << (unsigned int)(*i).r << " ";
+        if (++j == 19) {
+          os << "\n";
+          j = 0;
+        }
+        os << (unsigned int)(*i).g << " ";
+        if (++j == 19) {
+          os << "\n";
+          j = 0;
+        }
+        os << (unsigned int)(*i).b << " ";
+        if (++j == 19) {
+          os << "\n";
+          j = 0;
+        }
+      } else {
+        os << (*i).r << (*i).g << (*i).b;
       }
-    } else {
-      os << (*i).r << (*i).g << (*i).b;
+    }
+    if (y % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+      releaseRows(f, y + 1 - STORAGE_TILE_ROWS, y + 1);
     }
   }
 }
@@ -241,21 +307,260 @@ void printPnm(const Frame<PixelValue>& f, ostream& os, bool binary) {
 
 void printPnm(const FrameWrapper& img, std::ostream& out, bool binary) {
   if (img.color) {
-    printPpm(*img.colorFrame, out, binary);
+    printPpm(img.colorFrame, out, binary);
   } else {
-    printPgm(*img.greyFrame, out, binary);
+    printPgm(img.greyFrame, out, binary);
   }
 }
 
-void writePnm(const FrameWrapper& img, string name) {
-  fstream ofile(name.c_str(), fstream::out);
-  printPnm(img, ofile);
+/* QOI (Quite OK Image): https://qoiformat.org/qoi-specification.pdf
+   Frames are written as 3 channel images; grey frames have r == g == b,
+   which comes out as runs and small diffs. */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HEADER_SIZE 14
+// as in the reference decoder, which rejects larger headers
+#define QOI_PIXELS_MAX 400000000
+#define QOI_MAX_RUN 62
+// bytes buffered before each write
+#define QOI_CHUNK_SIZE (1 << 16)
+
+static const unsigned char qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static size_t qoiHash(const RgbPixel& p, PixelValue a) {
+  return (p.r * 3 + p.g * 5 + p.b * 7 + a * 11) % 64;
+}
+
+static bool samePixel(const RgbPixel& a, const RgbPixel& b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static RgbPixel toRgb(const RgbPixel& p) {
+  return p;
+}
+
+static RgbPixel toRgb(PixelValue v) {
+  RgbPixel p;
+  p.r = p.g = p.b = v;
+  return p;
+}
+
+static void putBigEndian(string& out, uint32_t v) {
+  out += (char)(v >> 24);
+  out += (char)(v >> 16);
+  out += (char)(v >> 8);
+  out += (char)v;
+}
+
+static uint32_t getBigEndian(const unsigned char* in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | in[3];
+}
+
+bool loadQoi(istream& is, FrameWrapper& frame) {
+  unsigned char header[QOI_HEADER_SIZE];
+  if (!is.read((char*)header, QOI_HEADER_SIZE) ||
+      string((char*)header, 4) != "qoif") {
+    return false;
+  }
+  size_t w = getBigEndian(header + 4), h = getBigEndian(header + 8);
+  if ((header[12] != 3 && header[12] != 4) || w == 0 || h == 0 ||
+      h > QOI_PIXELS_MAX / w) {
+    return false;
+  }
+
+  Frame<RgbPixel> r(w, h);
+  streambuf* in = is.rdbuf();
+  RgbPixel index[64];
+  PixelValue alpha[64] = { 0 };
+  RgbPixel px;
+  PixelValue a = 255;
+  size_t run = 0;
+  bool grey = true;
+  for (Frame<RgbPixel>::ValuesSet::iterator i = r.values.begin();
+       i != r.values.end(); ++i) {
+    if (run > 0) {
+      run--;
+    } else {
+      int b1 = in->sbumpc();
+      if (b1 == char_traits<char>::eof()) {
+        return false;
+      }
+      if (b1 == QOI_OP_RGB || b1 == QOI_OP_RGBA) {
+        px.r = in->sbumpc();
+        px.g = in->sbumpc();
+        px.b = in->sbumpc();
+        if (b1 == QOI_OP_RGBA) a = in->sbumpc();
+      } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+        px = index[b1];
+        a = alpha[b1];
+      } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+        px.r += ((b1 >> 4) & 0x03) - 2;
+        px.g += ((b1 >> 2) & 0x03) - 2;
+        px.b += (b1 & 0x03) - 2;
+      } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+        int b2 = in->sbumpc();
+        int vg = (b1 & 0x3f) - 32;
+        px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+        px.g += vg;
+        px.b += vg - 8 + (b2 & 0x0f);
+      } else {
+        run = b1 & 0x3f;
+      }
+      size_t hash = qoiHash(px, a);
+      index[hash] = px;
+      alpha[hash] = a;
+    }
+    *i = px;
+    grey = grey && px.r == px.g && px.g == px.b;
+  }
+
+  // alpha is dropped; images without any color come back grey
+  if (grey) {
+    Frame<PixelValue> g(w, h);
+    for (size_t j = 0; j < r.values.size(); j++) {
+      g.values[j] = r.values[j].r;
+    }
+    frame = FrameWrapper(move(g));
+  } else {
+    frame = FrameWrapper(move(r));
+  }
+  return true;
+}
+
+template<typename T>
+static void do_printQoi(const Frame<T>& f, ostream& os) {
+  string out;
+  out.reserve(QOI_CHUNK_SIZE + 8);
+  out += "qoif";
+  putBigEndian(out, f.w);
+  putBigEndian(out, f.h);
+  out += (char)3; // channels
+  out += (char)0; // sRGB
+
+  RgbPixel index[64];
+  bool used[64] = { false };
+  RgbPixel prev;
+  size_t run = 0;
+  for (size_t y = 0; y < f.h; y++) {
+    typename Frame<T>::ValuesSet::const_iterator row =
+      f.values.begin() + y * f.stride;
+    for (typename Frame<T>::ValuesSet::const_iterator i = row;
+         i != row + f.w; ++i) {
+      RgbPixel px = toRgb(*i);
+      if (samePixel(px, prev)) {
+        if (++run == QOI_MAX_RUN) {
+          out += (char)(QOI_OP_RUN | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        out += (char)(QOI_OP_RUN | (run - 1));
+        run = 0;
+      }
+      size_t hash = qoiHash(px, 255);
+      if (used[hash] && samePixel(index[hash], px)) {
+        out += (char)(QOI_OP_INDEX | hash);
+      } else {
+        index[hash] = px;
+        used[hash] = true;
+        signed char vr = px.r - prev.r;
+        signed char vg = px.g - prev.g;
+        signed char vb = px.b - prev.b;
+        signed char vg_r = vr - vg;
+        signed char vg_b = vb - vg;
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+          out += (char)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 |
+                        (vb + 2));
+        } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                   vg_b > -9 && vg_b < 8) {
+          out += (char)(QOI_OP_LUMA | (vg + 32));
+          out += (char)((vg_r + 8) << 4 | (vg_b + 8));
+        } else {
+          out += (char)QOI_OP_RGB;
+          out += (char)px.r;
+          out += (char)px.g;
+          out += (char)px.b;
+        }
+      }
+      prev = px;
+      if (out.size() >= QOI_CHUNK_SIZE) {
+        os.write(out.data(), out.size());
+        out.clear();
+      }
+    }
+    if (y % STORAGE_TILE_ROWS == STORAGE_TILE_ROWS - 1) {
+      releaseRows(f, y + 1 - STORAGE_TILE_ROWS, y + 1);
+    }
+  }
+  if (run > 0) {
+    out += (char)(QOI_OP_RUN | (run - 1));
+  }
+  out.append((const char*)qoi_padding, sizeof(qoi_padding));
+  os.write(out.data(), out.size());
+}
+
+void printQoi(const Frame<RgbPixel>& f, ostream& os) {
+  do_printQoi(f, os);
+}
+
+void printQoi(const Frame<PixelValue>& f, ostream& os) {
+  do_printQoi(f, os);
+}
+
+void printQoi(const FrameWrapper& img, ostream& os) {
+  if (img.color) {
+    do_printQoi(img.colorFrame, os);
+  } else {
+    do_printQoi(img.greyFrame, os);
+  }
+}
+
+static bool isQoiName(const string& name) {
+  if (name.size() < 4) return false;
+  string ext = name.substr(name.size() - 4);
+  for (size_t i = 0; i < ext.size(); i++) {
+    ext[i] = tolower(ext[i]);
+  }
+  return ext == ".qoi";
+}
+
+template<typename T>
+static void do_writePnm(const T& img, const string& name) {
+  TraceScope trace("writePnm");
+  fstream ofile(name.c_str(), fstream::out | fstream::binary);
+  if (isQoiName(name)) {
+    printQoi(img, ofile);
+  } else {
+    printPnm(img, ofile);
+  }
   ofile.close();
 }
 
-FrameWrapper* readPnm(string name) {
-  fstream ifile(name.c_str(), fstream::in);
-  FrameWrapper* inputImage = loadPnm(ifile);
+void writePnm(const Frame<RgbPixel>& img, string name) {
+  do_writePnm(img, name);
+}
+
+void writePnm(const Frame<PixelValue>& img, string name) {
+  do_writePnm(img, name);
+}
+
+void writePnm(const FrameWrapper& img, string name) {
+  do_writePnm(img, name);
+}
+
+bool readPnm(string name, FrameWrapper& frame) {
+  TraceScope trace("readPnm");
+  fstream ifile(name.c_str(), fstream::in | fstream::binary);
+  // every PNM magic starts with 'P'
+  bool ok = (ifile.peek() == 'q') ? loadQoi(ifile, frame)
+                                  : loadPnm(ifile, frame);
   ifile.close();
-  return inputImage;
+  return ok;
 }
@@ -28,37 +28,78 @@
 #include <istream>
 #include <ostream>
 #include <string>
+#include <utility>
+#include <functional>
 
 #include "const.h"
+#include "storage.h"
 
 typedef std::uint8_t PixelValue;
 
 template<typename T> struct Frame {
-  typedef std::vector<T> ValuesSet;
+  typedef std::vector<T, StorageAllocator<T> > ValuesSet;
 
   std::size_t w;
   std::size_t h;
+  // Distance between rows in values. Equal to w unless the frame has
+  // been carved in place, in which case it keeps its original stride.
+  std::size_t stride;
   ValuesSet values;
 
-  Frame() {}
-  Frame(std::size_t w, std::size_t h) : w(w), h(h) {
+  Frame() : w(0), h(0), stride(0) {}
+  Frame(std::size_t w, std::size_t h) : w(w), h(h), stride(w) {
     values.resize(w * h);
   }
+  Frame(std::size_t w, std::size_t h, std::size_t stride) : w(w), h(h),
+    stride(stride) {
+    values.resize(stride * h);
+  }
+  Frame(const Frame<T>& other) : w(other.w), h(other.h),
+    stride(other.stride), values(other.values) { }
+  // takes the values of other, leaving it empty
+  Frame(Frame<T>&& other) : w(other.w), h(other.h), stride(other.stride),
+    values(std::move(other.values)) {
+    other.w = other.h = other.stride = 0;
+  }
 
   Frame<T>& operator=(const Frame<T>& other) {
     if (this != &other) {
       this->w = other.w;
       this->h = other.h;
+      this->stride = other.stride;
       this->values = other.values;
     }
     return *this;
   }
+
+  Frame<T>& operator=(Frame<T>&& other) {
+    if (this != &other) {
+      this->w = other.w;
+      this->h = other.h;
+      this->stride = other.stride;
+      this->values = std::move(other.values);
+      other.w = other.h = other.stride = 0;
+    }
+    return *this;
+  }
 };
 
+/* Drops rows [from, to) of a file backed frame from memory. Streaming
+   passes call this every STORAGE_TILE_ROWS rows to bound their working
+   set. */
+template<typename T>
+void releaseRows(const Frame<T>& frame, std::size_t from, std::size_t to) {
+  if (to > from) {
+    releaseStorage(&frame.values[from * frame.stride],
+                   (to - from) * frame.stride * sizeof(T));
+  }
+}
+
 struct RgbPixel {
   PixelValue r, g, b;
 
   RgbPixel() : r(0), g(0), b(0) { }
+  RgbPixel(const RgbPixel& o) : r(o.r), g(o.g), b(o.b) { }
 
   RgbPixel& operator=(const RgbPixel& b) {
     if (this != &b) {
@@ -77,67 +118,74 @@ struct RgbPixel {
   }
 };
 
+/* A grey or a color frame. Only the one color picks holds pixels; the
+   other stays empty. Move only, so that passing an image on never copies
+   it by accident. */
 struct FrameWrapper {
   bool color;
-  union {
-    Frame<RgbPixel>* colorFrame;
-    Frame<PixelValue>* greyFrame;
-  };
+  Frame<RgbPixel> colorFrame;
+  Frame<PixelValue> greyFrame;
 
   FrameWrapper() : color(true) { }
-
-  FrameWrapper(const FrameWrapper& frame) : color(frame.color) {
-    if (color) {
-      colorFrame = new Frame<RgbPixel>;
-      *colorFrame = *frame.colorFrame;
-    } else {
-      greyFrame = new Frame<PixelValue>;
-      *greyFrame = *frame.greyFrame;
-    }
+  explicit FrameWrapper(bool color) : color(color) { }
+  explicit FrameWrapper(Frame<RgbPixel>&& frame) : color(true),
+    colorFrame(std::move(frame)) { }
+  explicit FrameWrapper(Frame<PixelValue>&& frame) : color(false),
+    greyFrame(std::move(frame)) { }
+
+  FrameWrapper(FrameWrapper&& other) : color(other.color),
+    colorFrame(std::move(other.colorFrame)),
+    greyFrame(std::move(other.greyFrame)) { }
+
+  FrameWrapper& operator=(FrameWrapper&& other) {
+    color = other.color;
+    colorFrame = std::move(other.colorFrame);
+    greyFrame = std::move(other.greyFrame);
+    return *this;
   }
 
-  FrameWrapper(bool color) : color(color) {
-    if (color) {
-      colorFrame = new Frame<RgbPixel>;
-    } else {
-      greyFrame = new Frame<PixelValue>;
-    }
-  }
+  FrameWrapper(const FrameWrapper&) = delete;
+  FrameWrapper& operator=(const FrameWrapper&) = delete;
 
   std::size_t getHeight() const {
-    return color?colorFrame->h:greyFrame->h;
+    return color?colorFrame.h:greyFrame.h;
   }
 
   std::size_t getWidth() const {
-    return color?colorFrame->w:greyFrame->w;
+    return color?colorFrame.w:greyFrame.w;
   }
 
   void setSize(std::size_t w, std::size_t h) {
     if (color) {
-      colorFrame->h = h;
-      colorFrame->w = w;
-      colorFrame->values.resize(colorFrame->h * colorFrame->w);
+      colorFrame.h = h;
+      colorFrame.w = colorFrame.stride = w;
+      colorFrame.values.resize(colorFrame.h * colorFrame.w);
     } else {
-      greyFrame->h = h;
-      greyFrame->w = w;
-      greyFrame->values.resize(greyFrame->h * greyFrame->w);
-    }
-  }
-
-  virtual ~FrameWrapper() {
-    if (color) {
-      delete colorFrame;
-    } else {
-      delete greyFrame;
+      greyFrame.h = h;
+      greyFrame.w = greyFrame.stride = w;
+      greyFrame.values.resize(greyFrame.h * greyFrame.w);
     }
   }
 };
 
 std::string getMagic(std::istream& is);
 
-Frame<PixelValue>* loadPgm(std::istream& is);
-Frame<RgbPixel>* loadPpm(std::istream& is);
-FrameWrapper* loadPnm(std::istream& is);
+/* Called by the loaders each time a row of the raster is in, with the
+   frame so far and its number of complete rows, so that work on them can
+   start while the rest is read */
+typedef std::function<void(const Frame<PixelValue>&, std::size_t)>
+  PgmRowsCallback;
+typedef std::function<void(const Frame<RgbPixel>&, std::size_t)>
+  PpmRowsCallback;
+
+// The loaders return false, leaving frame untouched, if the image is invalid
+bool loadPgm(std::istream& is, Frame<PixelValue>& frame,
+             const PgmRowsCallback& rows = PgmRowsCallback());
+bool loadPpm(std::istream& is, Frame<RgbPixel>& frame,
+             const PpmRowsCallback& rows = PpmRowsCallback());
+bool loadPnm(std::istream& is, FrameWrapper& frame);
+// Gives a grey frame if the image has no color. Alpha is dropped.
+bool loadQoi(std::istream& is, FrameWrapper& frame);
 
 void printPgm(const Frame<PixelValue>& f, std::ostream& os,
               bool binary=PNM_BINARY_DEFAULT);
@@ -151,7 +199,15 @@ void printPnm(const Frame<PixelValue>& img, std::ostream& out,
 void printPnm(const FrameWrapper& img, std::ostream& out,
               bool binary=PNM_BINARY_DEFAULT);
 
+void printQoi(const Frame<RgbPixel>& f, std::ostream& os);
+void printQoi(const Frame<PixelValue>& f, std::ostream& os);
+void printQoi(const FrameWrapper& img, std::ostream& os);
+
+// Names ending in .qoi are written as QOI, everything else as PNM
+void writePnm(const Frame<RgbPixel>& img, std::string name);
+void writePnm(const Frame<PixelValue>& img, std::string name);
 void writePnm(const FrameWrapper& img, std::string name);
-FrameWrapper* readPnm(std::string name);
+// Reads PNM or QOI, by the magic
+bool readPnm(std::string name, FrameWrapper& frame);
 
 #endif
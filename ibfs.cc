@@ -0,0 +1,352 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "ibfs.h"
+
+#include "const.h"
+#include "trace.h"
+
+using namespace std;
+
+typedef IbfsFlowState::DistType DistType;
+
+/* Returns true if from -> to has residual capacity. Only the edge to
+   from.next is finite. */
+static bool residual(const Point& from, const Point& to) {
+  return from.next != &to || from.flow < from.capacity;
+}
+
+// Residual capacity of the edge from a parent to its child in tree T
+template <Point::Tree T>
+static bool tree_residual(const Point& parent, const Point& child) {
+  return (T == Point::TREE_S) ? residual(parent, child)
+                              : residual(child, parent);
+}
+
+template <Point::Tree T>
+static bool is_root(const IbfsFlowState& state, const Point& p) {
+  return &p == ((T == Point::TREE_S) ? &state.s : &state.t);
+}
+
+template <Point::Tree T>
+static void addOrphan(IbfsFlowState& state, Point& p) {
+  IbfsFlowState::OrphanSet& O =
+    (T == Point::TREE_S) ? state.orphansS : state.orphansT;
+  p.parent = NULL;
+  addWork(state, p, WORK_ORPHANED);
+  if (O.size() <= p.dist) {
+    O.resize(p.dist + 1);
+  }
+  O[p.dist].push_back(&p);
+}
+
+/* Label of the layer of tree T that is still to be scanned: the one being
+   built while T is scanned, otherwise the next one. No node has a larger
+   label. */
+template <Point::Tree T>
+static DistType frontier(const IbfsFlowState& state) {
+  DistType dist = (T == Point::TREE_S) ? state.distS : state.distT;
+  return (state.scanning == T) ? dist + 1 : dist;
+}
+
+// Queues p, which must be labeled frontier<T>(), to be scanned
+template <Point::Tree T>
+static void addActive(IbfsFlowState& state, Point& p) {
+  addWork(state, p, WORK_ACTIVATED);
+  if (T == Point::TREE_S) {
+    (state.scanning == T ? state.nextS : state.activeS).push_back(&p);
+  } else {
+    (state.scanning == T ? state.nextT : state.activeT).push_back(&p);
+  }
+}
+
+/* Moves a node that just left the other tree into tree T, under the
+   closest neighbor that can still reach it. If that neighbor is still
+   to be scanned it will pick p up itself. */
+template <Point::Tree T>
+static void adoptFreed(IbfsFlowState& state, Point& p) {
+  Point::NeighborSet& parents = (T == Point::TREE_S) ? p.from : p.to;
+  Point* parent = NULL;
+  for (Point::NeighborSet::iterator i = parents.begin();
+       i != parents.end(); ++i) {
+    Point& x = **i;
+    if (x.tree == T && tree_residual<T>(x, p) &&
+        (parent == NULL || x.dist < parent->dist)) {
+      parent = &x;
+    }
+  }
+  if (parent != NULL && parent->dist < frontier<T>(state)) {
+    p.tree = T;
+    p.parent = parent;
+    p.dist = parent->dist + 1;
+    if (p.dist == frontier<T>(state)) {
+      addActive<T>(state, p);
+    }
+  }
+}
+
+/* Orphans are handled in increasing label order, so every node with a
+   smaller label already has its final parent. A parent one layer closer
+   keeps the label; otherwise the label is raised past the closest
+   remaining neighbor. If that is beyond the frontier, every neighbor that
+   could take p back is still to be scanned, so p just leaves the tree. */
+template <Point::Tree T>
+static void do_adoption(IbfsFlowState& state, Point& p) {
+  const Point::Tree other =
+    (T == Point::TREE_S) ? Point::TREE_T : Point::TREE_S;
+  Point::NeighborSet& parents = (T == Point::TREE_S) ? p.from : p.to;
+  Point::NeighborSet& children = (T == Point::TREE_S) ? p.to : p.from;
+
+  Point* parent = NULL;
+  for (Point::NeighborSet::iterator i = parents.begin();
+       i != parents.end(); ++i) {
+    Point& x = **i;
+    if (x.tree == T && x.dist < p.dist && tree_residual<T>(x, p) &&
+        (x.parent != NULL || is_root<T>(state, x)) &&
+        (parent == NULL || x.dist < parent->dist)) {
+      parent = &x;
+      if (x.dist + 1 == p.dist) break;
+    }
+  }
+  if (parent != NULL) {
+    p.parent = parent;
+    p.dist = parent->dist + 1;
+    return;
+  }
+
+  for (Point::NeighborSet::iterator i = children.begin();
+       i != children.end(); ++i) {
+    Point& x = **i;
+    if (x.tree == T && x.parent == &p) {
+      addOrphan<T>(state, x);
+    }
+  }
+
+  DistType dist = (DistType)~0;
+  for (Point::NeighborSet::iterator i = parents.begin();
+       i != parents.end(); ++i) {
+    Point& x = **i;
+    if (x.tree == T && x.dist < dist && tree_residual<T>(x, p)) {
+      dist = x.dist;
+    }
+  }
+  if (dist != (DistType)~0 && dist < frontier<T>(state)) {
+    p.dist = dist + 1;
+    addOrphan<T>(state, p);
+    if (p.dist == frontier<T>(state)) {
+      addActive<T>(state, p);
+    }
+  } else {
+    p.tree = Point::TREE_NONE;
+    adoptFreed<other>(state, p);
+  }
+}
+
+template <Point::Tree T>
+static void adopt(IbfsFlowState& state) {
+  IbfsFlowState::OrphanSet& O =
+    (T == Point::TREE_S) ? state.orphansS : state.orphansT;
+  // adoption only ever adds orphans with larger labels
+  for (size_t d = 0; d < O.size(); d++) {
+    while (!O[d].empty()) {
+      Point& p = *O[d].back();
+      O[d].pop_back();
+      // skip nodes that were adopted, freed or relabeled since
+      if (p.tree == T && p.parent == NULL && p.dist == d) {
+        addWork(state, p, WORK_ADOPTIONS);
+        do_adoption<T>(state, p);
+      }
+    }
+    // relabeling can queue the same nodes over and over, so don't keep
+    // the room until the end
+    IbfsFlowState::LayerSet().swap(O[d]);
+  }
+  O.clear();
+}
+
+/* Pushes flow along s -> ... -> a -> b -> ... -> t. Returns false if
+   every edge on the path is infinite. */
+static bool augment(IbfsFlowState& state, Point& a, Point& b) {
+  FlowState::EnergyType bottleneck = (FlowState::EnergyType)~0;
+  if (a.next == &b) {
+    bottleneck = a.capacity - a.flow;
+  }
+  for (Point* x = &a; x->parent != NULL; x = x->parent) {
+    Point& p = *x->parent;
+    if (p.next == x && p.capacity - p.flow < bottleneck) {
+      bottleneck = p.capacity - p.flow;
+    }
+  }
+  for (Point* x = &b; x->parent != NULL; x = x->parent) {
+    if (x->next == x->parent && x->capacity - x->flow < bottleneck) {
+      bottleneck = x->capacity - x->flow;
+    }
+  }
+  if (bottleneck == (FlowState::EnergyType)~0) return false;
+
+  state.s.flow += bottleneck;
+  if (a.next == &b) {
+    a.flow += bottleneck;
+  }
+  for (Point* x = &a; x->parent != NULL;) {
+    Point& p = *x->parent;
+    Point* c = x;
+    addWork(state, *c, WORK_PATHS);
+    x = x->parent;
+    if (p.next == c) {
+      p.flow += bottleneck;
+      if (p.flow >= p.capacity) {
+        addOrphan<Point::TREE_S>(state, *c);
+      }
+    }
+  }
+  for (Point* x = &b; x->parent != NULL;) {
+    Point& c = *x;
+    addWork(state, c, WORK_PATHS);
+    x = x->parent;
+    if (c.next == x) {
+      c.flow += bottleneck;
+      if (c.flow >= c.capacity) {
+        addOrphan<Point::TREE_T>(state, c);
+      }
+    }
+  }
+
+  adopt<Point::TREE_S>(state);
+  adopt<Point::TREE_T>(state);
+  return true;
+}
+
+/* Grows tree T from p by one layer, augmenting on every edge into the
+   other tree. Stops early if an augmentation takes p out of the layer;
+   if it was relabeled it has been queued again. */
+template <Point::Tree T>
+static void do_scan(IbfsFlowState& state, Point& p, DistType dist) {
+  Point::NeighborSet& children = (T == Point::TREE_S) ? p.to : p.from;
+  for (Point::NeighborSet::iterator i = children.begin();
+       i != children.end() && p.tree == T && p.dist == dist;) {
+    Point& x = **i;
+    if (!tree_residual<T>(p, x)) {
+      ++i;
+      continue;
+    }
+    if (x.tree == Point::TREE_NONE) {
+      x.tree = T;
+      x.parent = &p;
+      x.dist = p.dist + 1;
+      addActive<T>(state, x);
+      ++i;
+    } else if (x.tree != T) {
+      bool pushed = (T == Point::TREE_S) ? augment(state, p, x)
+                                         : augment(state, x, p);
+      // the same edge may still have room, so look at it again
+      if (!pushed) ++i;
+    } else {
+      ++i;
+    }
+  }
+}
+
+template <Point::Tree T>
+static bool scan(IbfsFlowState& state) {
+  IbfsFlowState::LayerSet& active =
+    (T == Point::TREE_S) ? state.activeS : state.activeT;
+  IbfsFlowState::LayerSet& next =
+    (T == Point::TREE_S) ? state.nextS : state.nextT;
+  DistType dist = (T == Point::TREE_S) ? state.distS : state.distT;
+
+  state.scanning = T;
+  for (size_t i = 0; i < active.size(); i++) {
+    if (state.cancelled) return false;
+    if (i % FLOW_CHECK_INTERVAL == 0 && !state.withinBudget(state.s.flow)) {
+      return false;
+    }
+    Point& p = *active[i];
+    // skip nodes that have left the layer since they were queued
+    if (p.tree == T && p.dist == dist) {
+      do_scan<T>(state, p, dist);
+    }
+  }
+  active.swap(next);
+  next.clear();
+  state.scanning = Point::TREE_NONE;
+  if (T == Point::TREE_S) {
+    state.distS++;
+  } else {
+    state.distT++;
+  }
+  return true;
+}
+
+FlowState::EnergyType IbfsFlowState::calcMaxFlow(FlowDirection direction) {
+  if (!startWithinBudget(direction)) return 0;
+
+  activeS.clear();
+  activeT.clear();
+  nextS.clear();
+  nextT.clear();
+  orphansS.clear();
+  orphansT.clear();
+  distS = distT = 0;
+  scanning = Point::TREE_NONE;
+
+  s = Point();
+  t = Point();
+
+  s.tree = Point::TREE_S;
+  t.tree = Point::TREE_T;
+
+  s.dist = t.dist = 0;
+
+  {
+    TraceScope trace("points.resize");
+    points.clear();
+    points.resize(getNumPoints(*this));
+    resetWork();
+  }
+
+  {
+    TraceScope trace("buildGraph");
+    if (direction == FLOW_LEFT_RIGHT) {
+      buildGraph<FLOW_LEFT_RIGHT>(*this);
+    } else {
+      buildGraph<FLOW_TOP_BOTTOM>(*this);
+    }
+  }
+
+  activeS.push_back(&s);
+  activeT.push_back(&t);
+
+  TraceScope trace("solve");
+
+  // scan whichever tree has the smaller layer
+  while (!activeS.empty() || !activeT.empty()) {
+    bool ok;
+    if (activeT.empty() ||
+        (!activeS.empty() && activeS.size() <= activeT.size())) {
+      ok = scan<Point::TREE_S>(*this);
+    } else {
+      ok = scan<Point::TREE_T>(*this);
+    }
+    if (!ok) break;
+  }
+  return s.flow;
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _IBFSENERGY_H
+#define _IBFSENERGY_H
+
+#include <vector>
+
+#include "energy.h"
+
+/* Incremental breadth-first search (Goldberg, Hed, Kaplan, Tarjan and
+   Werneck). Like Edmonds-Karp it grows an S and a T tree, but each tree
+   is grown a whole BFS layer at a time and every node carries its distance
+   label in dist. Orphans are re-adopted in label order by looking only at
+   the neighbors one layer closer, so no walk back to the terminal is ever
+   needed. */
+class IbfsFlowState : public FlowState {
+public:
+  typedef std::vector<Point*, CountingAllocator<Point*, MEMORY_QUEUES> >
+    LayerSet;
+  // orphans indexed by distance label
+  typedef std::vector<LayerSet, CountingAllocator<LayerSet, MEMORY_QUEUES> >
+    OrphanSet;
+
+  // label of the S and T layers being scanned
+  DistType distS;
+  DistType distT;
+
+  // current layer of each tree, and the one after it
+  LayerSet activeS;
+  LayerSet activeT;
+  LayerSet nextS;
+  LayerSet nextT;
+
+  OrphanSet orphansS;
+  OrphanSet orphansT;
+
+  // which tree is being scanned, so relabeled nodes go to the right layer
+  Point::Tree scanning;
+
+  IbfsFlowState(const FrameWrapper& frame) : FlowState(frame) { }
+  IbfsFlowState(Frame<PixelValue>* energy) : FlowState(energy) { }
+
+  virtual EnergyType calcMaxFlow(FlowDirection direction);
+
+  virtual ~IbfsFlowState() { }
+};
+
+#endif
@@ -23,18 +23,42 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <climits>
 
 #include "diff.h"
 
 using namespace std;
 
+static_assert(sizeof(RgbPixel) == 3,
+              "RgbPixel must match the Gdk::Pixbuf row layout");
+
 const static char* app_id = "com.allanwirth.carver";
 const static char* window_title = "Image Carver";
 const static char* button_h_label = "Shrink Horizontal";
 const static char* button_v_label = "Shrink Vertical";
-
-ImageCarver::ImageCarver() : _currentFrame(NULL), _debugFrame(NULL),
-    _state(NULL) {
+const static char* button_cancel_label = "Cancel";
+const static char* button_undo_label = "Undo";
+const static char* button_redo_label = "Redo";
+const static char* button_work_label = "Show Work";
+// in FlowDirection order
+const static char* size_axis_labels[] = {"Width", "Height"};
+
+ImageCarver::ImageCarver() : _buttonCancel(NULL), _buttonUndo(NULL),
+    _buttonRedo(NULL), _buttonWork(NULL),
+    _workCounter(NULL), _sizeSlider(NULL), _sizeAxis(NULL),
+    _currentFrame(NULL), _debugFrame(NULL),
+    _heatmap(NULL), _targetW(0), _targetH(0), _proxyFrame(NULL),
+    _proxyState(NULL), _proxyScale(1), _proxyStale(false),
+    _sliderDirection(FLOW_LEFT_RIGHT), _sliderCount(0), _sliderFrame(NULL),
+    _state(NULL), _busy(false),
+    _quit(false), _countWork(false), _counter(DEFAULT_WORK_COUNTER),
+    _resultHeatmap(NULL), _aheadEnergy(NULL),
+    _aheadDirection(FLOW_LEFT_RIGHT), _aheadGen(0), _aheadCarved(0),
+    _aheadLimit(PRECOMPUTE_AHEAD_SEAMS), _aheadState(NULL),
+    _aheadStateGen(0) {
 
   set_title(window_title);
   set_border_width(10);
@@ -68,27 +92,121 @@ ImageCarver::ImageCarver() : _currentFrame(NULL), _debugFrame(NULL),
   _buttonV->signal_clicked().connect(sigc::mem_fun(*this,
     &ImageCarver::button_v_clicked));
 
+  _buttonCancel = new Gtk::Button(button_cancel_label);
+  _buttonBox->pack_start(*_buttonCancel);
+  _buttonCancel->signal_clicked().connect(sigc::mem_fun(*this,
+    &ImageCarver::button_cancel_clicked));
+  _buttonCancel->set_sensitive(false);
+
+  _buttonUndo = new Gtk::Button(button_undo_label);
+  _buttonBox->pack_start(*_buttonUndo);
+  _buttonUndo->signal_clicked().connect(sigc::mem_fun(*this,
+    &ImageCarver::button_undo_clicked));
+  _buttonUndo->set_sensitive(false);
+
+  _buttonRedo = new Gtk::Button(button_redo_label);
+  _buttonBox->pack_start(*_buttonRedo);
+  _buttonRedo->signal_clicked().connect(sigc::mem_fun(*this,
+    &ImageCarver::button_redo_clicked));
+  _buttonRedo->set_sensitive(false);
+
+  _buttonWork = new Gtk::ToggleButton(button_work_label);
+  _buttonBox->pack_start(*_buttonWork);
+  _buttonWork->signal_toggled().connect(sigc::mem_fun(*this,
+    &ImageCarver::work_changed));
+
+  _workCounter = new Gtk::ComboBoxText();
+  for (size_t i = 0; i < NUM_WORK_COUNTERS; i++) {
+    _workCounter->append(getWorkCounterName((WorkCounter)i));
+  }
+  _workCounter->set_active(DEFAULT_WORK_COUNTER);
+  _buttonBox->pack_start(*_workCounter);
+  _workCounter->signal_changed().connect(sigc::mem_fun(*this,
+    &ImageCarver::work_changed));
+
+  Gtk::HBox *_sizeBox = new Gtk::HBox();
+  _mainBox->pack_end(*_sizeBox, false, false);
+
+  _sizeAxis = new Gtk::ComboBoxText();
+  for (size_t i = 0; i < 2; i++) {
+    _sizeAxis->append(size_axis_labels[i]);
+  }
+  _sizeAxis->set_active(FLOW_LEFT_RIGHT);
+  _sizeBox->pack_start(*_sizeAxis, false, false);
+  _sizeAxis->signal_changed().connect(sigc::mem_fun(*this,
+    &ImageCarver::size_axis_changed));
+
+  // only as far as has been carved ahead
+  _sizeSlider = new Gtk::Scale(Gtk::ORIENTATION_HORIZONTAL);
+  _sizeSlider->set_digits(0);
+  _sizeSlider->set_increments(1, 10);
+  _sizeSlider->set_show_fill_level(true);
+  _sizeSlider->set_restrict_to_fill_level(true);
+  _sizeBox->pack_start(*_sizeSlider, true, true);
+  _sizeSlider->signal_value_changed().connect(sigc::mem_fun(*this,
+    &ImageCarver::slider_changed));
+  _sizeSlider->signal_format_value().connect(sigc::mem_fun(*this,
+    &ImageCarver::slider_format));
+
+  _dispatcher.connect(sigc::mem_fun(*this, &ImageCarver::worker_done));
+  _aheadDispatcher.connect(sigc::mem_fun(*this, &ImageCarver::ahead_done));
+
   _mainBox->show_all();
 }
 
 ImageCarver::~ImageCarver() {
+  stop_worker();
+  _image.clear();
+  _debugImage.clear();
   delete _currentFrame;
   delete _debugFrame;
+  delete _heatmap;
+  delete _resultHeatmap;
+  delete _proxyFrame;
+  delete _proxyState;
+  delete _sliderFrame;
+  delete _aheadEnergy;
+  delete _aheadState;
   delete _state;
 }
 
-void ImageCarver::setFrame(FrameWrapper* frame) {
+void ImageCarver::setFrame(FrameWrapper&& frame) {
+  stop_worker();
+  _image.clear();
+  _debugImage.clear();
   delete _state;
   delete _currentFrame;
   delete _debugFrame;
-  _currentFrame = new FrameWrapper(*frame);
-  _debugFrame = new FrameWrapper(*frame);
-  _state = getNewFlowState(*_currentFrame);
+  delete _heatmap;
+  delete _resultHeatmap;
+  _heatmap = _resultHeatmap = NULL;
+  _results.clear();
+  _history.clear();
+  _redo.clear();
+  delete _aheadEnergy;
+  delete _aheadState;
+  _aheadEnergy = NULL;
+  _aheadState = NULL;
+  _aheadResults.clear();
+  _lastSeam.positions.clear();
+  _state = getNewFlowState(frame);
+  _debugFrame = new Frame<RgbPixel>(frame.getWidth(), frame.getHeight());
+  RgbPixel white;
+  white.r = white.g = white.b = 0xff;
+  fill(_debugFrame->values.begin(), _debugFrame->values.end(), white);
+  // the state has its energy, so the pixels can be taken
+  _currentFrame = getRgb(move(frame));
+  _targetW = _currentFrame->w;
+  _targetH = _currentFrame->h;
+  make_proxy();
+  _proxyStale = false;
+  start_worker();
+  history_changed();
 
   int maxw = get_screen()->get_width()/2;
   int maxh = get_screen()->get_height()/2;
-  int fw = _currentFrame->getWidth();
-  int fh = _currentFrame->getHeight();
+  int fw = _currentFrame->w;
+  int fh = _currentFrame->h;
   int neww = fw * 2 < maxw ? fw*2 : maxw;
   int newh = fh * 2 < maxh ? fh*2 : maxh;
 
@@ -98,11 +216,67 @@ void ImageCarver::setFrame(FrameWrapper* frame) {
   update();
 }
 
+// Only the pixels of the last seam differ from white in the debug pane
+void ImageCarver::mark_seam(const RgbPixel& value) {
+  const vector<size_t>& seam = _lastSeam.positions;
+  Frame<RgbPixel>& f = *_debugFrame;
+  for (size_t i = 0; i < seam.size(); i++) {
+    if (_lastSeam.direction == FLOW_LEFT_RIGHT) {
+      f.values[min(seam[i], f.w - 1) + i * f.stride] = value;
+    } else {
+      f.values[i + min(seam[i], f.h - 1) * f.stride] = value;
+    }
+  }
+}
+
+// Starts the proxy again from _currentFrame, once the worker is idle
+void ImageCarver::make_proxy() {
+  delete _proxyFrame;
+  delete _proxyState;
+  _proxyFrame = NULL;
+  _proxyState = NULL;
+  size_t pixels = _currentFrame->w * _currentFrame->h;
+  if (pixels <= PREVIEW_MAX_PIXELS) return;
+  _proxyScale = (size_t)ceil(sqrt((double)pixels / PREVIEW_MAX_PIXELS));
+  _proxyFrame = new Frame<RgbPixel>;
+  shrinkFrame(*_currentFrame, *_proxyFrame, _proxyScale);
+  _proxyState = getNewFlowState(getDifferential(*_proxyFrame));
+}
+
+/* Cuts the proxy down to the target size. Every seam gets
+   PREVIEW_BUDGET_MS, after which the cheapest path is cut instead. */
+void ImageCarver::carve_proxy() {
+  if (_proxyStale) {
+    make_proxy();
+    _proxyStale = false;
+  }
+  if (_proxyFrame == NULL) return;
+  size_t w = (_targetW + _proxyScale - 1) / _proxyScale;
+  size_t h = (_targetH + _proxyScale - 1) / _proxyScale;
+  while ((_proxyFrame->w > w || _proxyFrame->h > h) &&
+         _proxyFrame->w > 1 && _proxyFrame->h > 1) {
+    _proxyState->deadline = FlowState::Clock::now() +
+                            std::chrono::milliseconds(PREVIEW_BUDGET_MS);
+    _proxyState->calcMaxFlow((_proxyFrame->w > w) ? FLOW_LEFT_RIGHT
+                                                  : FLOW_TOP_BOTTOM);
+    _proxyState->cutFrame(*_proxyFrame);
+  }
+}
+
 void ImageCarver::update() {
-  if (_currentFrame != NULL) {
+  if (_sliderCount > 0) {
+    _image.set(pixbuf_from_frame(_sliderFrame));
+  } else if (_proxyFrame != NULL && (_targetW != _currentFrame->w ||
+                              _targetH != _currentFrame->h)) {
+    // nearest is the only scaling cheap enough for a full size image
+    _image.set(pixbuf_from_frame(_proxyFrame)->scale_simple(
+      _targetW, _targetH, Gdk::INTERP_NEAREST));
+  } else if (_currentFrame != NULL) {
     _image.set(pixbuf_from_frame(_currentFrame));
   }
-  if (_debugFrame != NULL) {
+  if (_heatmap != NULL) {
+    _debugImage.set(pixbuf_from_frame(_heatmap));
+  } else if (_debugFrame != NULL) {
     _debugImage.set(pixbuf_from_frame(_debugFrame));
   }
 }
@@ -115,41 +289,468 @@ void ImageCarver::button_v_clicked() {
   do_carve(FLOW_TOP_BOTTOM);
 }
 
-void ImageCarver::do_carve(FlowDirection direction) {
-  if (_currentFrame != NULL) {
-    _state->calcMaxFlow(direction);
-    FrameWrapper* tempCut = new FrameWrapper(_currentFrame->color);
-    tempCut->setSize(_currentFrame->getWidth(),
-                     _currentFrame->getHeight());
-    FrameWrapper* temp = _state->cutFrame(*_currentFrame, tempCut);
-    delete _currentFrame;
-    delete _debugFrame;
-    _currentFrame = temp;
-    _debugFrame = tempCut;
+void ImageCarver::button_cancel_clicked() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _jobs.clear();
+  if (_state != NULL) {
+    _state->cancel();
+  }
+}
+
+// Undo and redo change _state, so only while the worker waits for a job
+bool ImageCarver::worker_idle() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return !_busy && _jobs.empty();
+}
+
+/* Puts the last seam back into both frames and the energy, from what it
+   removed. No max flow is run either way. */
+void ImageCarver::button_undo_clicked() {
+  // a size on the slider is undone by going back to the current one
+  if (_sliderCount > 0) {
+    _sizeSlider->set_value(0);
+    return;
+  }
+  if (_history.empty() || !worker_idle()) return;
+  SeamRecord record = move(_history.back());
+  _history.pop_back();
+
+  RgbPixel white, black;
+  white.r = white.g = white.b = 0xff;
+  mark_seam(white);
+  insertSeam(*_state->energy, record.seam, record.energy);
+  insertSeam(*_currentFrame, record.seam, record.pixels);
+  if (record.seam.direction == FLOW_LEFT_RIGHT) {
+    _debugFrame->w++;
+  } else {
+    _debugFrame->h++;
+  }
+  _lastSeam = _history.empty() ? Seam() : _history.back().seam;
+  mark_seam(black);
+
+  _redo.push_back(move(record));
+  history_changed();
+}
+
+// Removes the last undone seam again
+void ImageCarver::button_redo_clicked() {
+  if (_redo.empty() || _sliderCount > 0 || !worker_idle()) return;
+  SeamRecord record = move(_redo.back());
+  _redo.pop_back();
+
+  RgbPixel white, black;
+  white.r = white.g = white.b = 0xff;
+  mark_seam(white);
+  removeSeam(*_state->energy, record.seam);
+  removeSeam(*_currentFrame, record.seam);
+  if (record.seam.direction == FLOW_LEFT_RIGHT) {
+    _debugFrame->w--;
+  } else {
+    _debugFrame->h--;
+  }
+  _lastSeam = record.seam;
+  mark_seam(black);
+
+  _history.push_back(move(record));
+  history_changed();
+}
+
+// After the frames changed under the proxy and the heatmap
+void ImageCarver::history_changed() {
+  _targetW = _currentFrame->w;
+  _targetH = _currentFrame->h;
+  _proxyStale = true;
+  delete _heatmap;
+  _heatmap = NULL;
+  bool idle = worker_idle();
+  _buttonUndo->set_sensitive(idle && !_history.empty());
+  _buttonRedo->set_sensitive(idle && !_redo.empty());
+  reset_ahead();
+  update();
+}
+
+/* Drops the seams carved ahead and, if the worker is idle, has it start
+   again from the current energy in the direction picked */
+void ImageCarver::reset_ahead() {
+  bool idle;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    idle = !_busy && _jobs.empty();
+    _aheadGen++;
+    _aheadResults.clear();
+    _aheadCarved = 0;
+    _aheadLimit = PRECOMPUTE_AHEAD_SEAMS;
+    delete _aheadEnergy;
+    _aheadEnergy = idle ? new Frame<PixelValue>(*_state->energy) : NULL;
+    _aheadDirection = (FlowDirection)_sizeAxis->get_active_row_number();
+    if (_aheadState != NULL) {
+      _aheadState->cancel();
+    }
+    _wake.notify_one();
+  }
+  _sliderDirection = (FlowDirection)_sizeAxis->get_active_row_number();
+  _aheadSeams.clear();
+  if (idle) {
+    _order.assign(_currentFrame->w * _currentFrame->h, UINT_MAX);
+  } else {
+    vector<unsigned>().swap(_order);
+  }
+  _sliderCount = 0;
+  delete _sliderFrame;
+  _sliderFrame = NULL;
+
+  size_t extent = (_sliderDirection == FLOW_LEFT_RIGHT) ? _currentFrame->w
+                                                        : _currentFrame->h;
+  _sizeSlider->set_range(0, extent - 1);
+  _sizeSlider->set_fill_level(0);
+  _sizeSlider->set_value(0);
+  _sizeSlider->set_sensitive(idle);
+}
+
+// Shows the current size less the seams on the slider, from _order
+void ImageCarver::slider_changed() {
+  unsigned count = (unsigned)_sizeSlider->get_value();
+  if (count > _aheadSeams.size()) count = _aheadSeams.size();
+  if (count + PRECOMPUTE_AHEAD_RESUME >= _aheadSeams.size()) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_aheadLimit < count + PRECOMPUTE_AHEAD_SEAMS) {
+      _aheadLimit = count + PRECOMPUTE_AHEAD_SEAMS;
+      _wake.notify_one();
+    }
+  }
+  if (count == _sliderCount) return;
+  _sliderCount = count;
+  if (count > 0) {
+    if (_sliderFrame == NULL) {
+      _sliderFrame = new Frame<RgbPixel>(_currentFrame->w, _currentFrame->h);
+    }
+    retargetFrame(*_currentFrame, *_sliderFrame, _order, _sliderDirection,
+                  count);
+  }
+  _buttonUndo->set_sensitive(count > 0 || !_history.empty());
+  _buttonRedo->set_sensitive(count == 0 && !_redo.empty());
+  update();
+}
+
+// The slider counts seams, but shows the size they leave
+Glib::ustring ImageCarver::slider_format(double value) {
+  if (_currentFrame == NULL) return Glib::ustring();
+  size_t extent = (_sliderDirection == FLOW_LEFT_RIGHT) ? _currentFrame->w
+                                                        : _currentFrame->h;
+  return to_string(extent - (size_t)value);
+}
+
+void ImageCarver::size_axis_changed() {
+  if (_currentFrame == NULL) return;
+  if (!apply_slider()) {
+    reset_ahead();
     update();
   }
 }
 
-Glib::RefPtr<Gdk::Pixbuf> ImageCarver::pixbuf_from_frame (FrameWrapper* frame) {
-  Glib::RefPtr<Gdk::Pixbuf> result = Gdk::Pixbuf::create(Gdk::COLORSPACE_RGB,
-    false, 8, frame->getWidth(), frame->getHeight());
-  guint8* pixels = result->get_pixels();
-  for (size_t y = 0; y < frame->getHeight(); y++) {
-    for (size_t x = 0; x < frame->getWidth(); x++) {
-      size_t i = y * result->get_rowstride() + (x * 3);
-      if (frame->color) {
-        Frame<RgbPixel>* f = frame->colorFrame;
-        RgbPixel& pixel = f->values[x + y * f->w];
-        pixels[i] = pixel.r;
-        pixels[i + 1] = pixel.g;
-        pixels[i + 2] = pixel.b;
-      } else {
-        Frame<PixelValue>* f = frame->greyFrame;
-        pixels[i] = pixels[i + 1] = pixels[i + 2] = f->values[x + y * f->w];
+/* Cuts the seams on the slider from the frame and the energy, in one
+   pass each, and records them as if the worker had carved them. False if
+   the slider is at the current size. */
+bool ImageCarver::apply_slider() {
+  if (_sliderCount == 0) return false;
+  unsigned count = _sliderCount;
+  SeamStack records(count);
+  for (size_t i = 0; i < count; i++) {
+    size_t n = _aheadSeams[i].positions.size();
+    records[i].seam = _aheadSeams[i];
+    records[i].pixels.resize(n);
+    records[i].energy.resize(n);
+  }
+  // seams don't change the energy left, so what they remove is the same
+  // as if they had been cut one by one
+  const Frame<RgbPixel>& frame = *_currentFrame;
+  const Frame<PixelValue>& energy = *_state->energy;
+  for (size_t y = 0; y < frame.h; y++) {
+    for (size_t x = 0; x < frame.w; x++) {
+      unsigned step = _order[x + y * frame.w];
+      if (step >= count) continue;
+      size_t i = (_sliderDirection == FLOW_LEFT_RIGHT) ? y : x;
+      records[step].pixels[i] = frame.values[x + y * frame.stride];
+      records[step].energy[i] = energy.values[x + y * energy.stride];
+    }
+  }
+  retargetFrame(*_currentFrame, *_currentFrame, _order, _sliderDirection,
+                count);
+  retargetFrame(*_state->energy, *_state->energy, _order, _sliderDirection,
+                count);
+
+  RgbPixel white, black;
+  white.r = white.g = white.b = 0xff;
+  mark_seam(white);
+  if (_sliderDirection == FLOW_LEFT_RIGHT) {
+    _debugFrame->w -= count;
+  } else {
+    _debugFrame->h -= count;
+  }
+  _lastSeam = records.back().seam;
+  mark_seam(black);
+
+  for (size_t i = 0; i < count; i++) {
+    _history.push_back(move(records[i]));
+  }
+  _redo.clear();
+  history_changed();
+  return true;
+}
+
+// The heatmap shown is dropped until the next carve counts the new work
+void ImageCarver::work_changed() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _countWork = _buttonWork->get_active();
+    _counter = (WorkCounter)_workCounter->get_active_row_number();
+  }
+  delete _heatmap;
+  _heatmap = NULL;
+  update();
+}
+
+void ImageCarver::do_carve(FlowDirection direction) {
+  if (_currentFrame == NULL) return;
+  apply_slider();
+  if (_targetW < 2 || _targetH < 2) return;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_jobs.empty() && _jobs.back().direction == direction) {
+      _jobs.back().count++;
+    } else {
+      CarveJob job;
+      job.direction = direction;
+      job.count = 1;
+      _jobs.push_back(job);
+    }
+    _buttonCancel->set_sensitive(true);
+    _wake.notify_one();
+  }
+
+  if (direction == FLOW_LEFT_RIGHT) {
+    _targetW--;
+  } else {
+    _targetH--;
+  }
+  _redo.clear();
+  _buttonUndo->set_sensitive(false);
+  _buttonRedo->set_sensitive(false);
+  reset_ahead();
+  carve_proxy();
+  update();
+}
+
+void ImageCarver::start_worker() {
+  _quit = false;
+  _worker = std::thread(&ImageCarver::worker_run, this);
+}
+
+void ImageCarver::stop_worker() {
+  if (!_worker.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _quit = true;
+    _jobs.clear();
+    _state->cancel();
+    if (_aheadState != NULL) {
+      _aheadState->cancel();
+    }
+    _wake.notify_one();
+  }
+  _worker.join();
+}
+
+// Runs on the worker thread. Never touches widgets; results are handed
+// over through _results, _resultHeatmap and _dispatcher.
+void ImageCarver::worker_run() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+    while (!_quit && _jobs.empty() && !ahead_pending()) {
+      _wake.wait(lock);
+    }
+    if (_quit) return;
+    if (_jobs.empty()) {
+      carve_ahead(lock);
+      continue;
+    }
+
+    CarveJob job = _jobs.front();
+    _jobs.pop_front();
+    _busy = true;
+    _state->cancelled = false;
+    _state->countWork = _countWork;
+    WorkCounter counter = _counter;
+    lock.unlock();
+
+    ResultQueue done;
+    Frame<RgbPixel>* heatmap = NULL;
+    for (size_t i = 0; i < job.count; i++) {
+      if (_state->energy->w < 2 || _state->energy->h < 2) break;
+      _state->calcMaxFlow(job.direction);
+      if (_state->cancelled) break;
+      if (_state->countWork) {
+        delete heatmap;
+        heatmap = getWorkHeatmap(*_state, counter);
+      }
+      done.push_back(SeamRecord());
+      _state->cutEnergy(done.back().seam, &done.back().energy);
+    }
+
+    lock.lock();
+    _results.insert(_results.end(), done.begin(), done.end());
+    if (heatmap != NULL) {
+      delete _resultHeatmap;
+      _resultHeatmap = heatmap;
+    }
+    _busy = !_jobs.empty();
+    _dispatcher.emit();
+  }
+}
+
+// Runs on the UI thread whenever the worker posts seams. The displayed
+// frames are updated in place rather than rebuilt from the worker's frame.
+void ImageCarver::worker_done() {
+  ResultQueue results;
+  Frame<RgbPixel>* heatmap;
+  bool busy;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    results.swap(_results);
+    heatmap = _resultHeatmap;
+    _resultHeatmap = NULL;
+    busy = _busy || !_jobs.empty();
+  }
+  // counted before the toggle was switched off
+  if (heatmap != NULL && !_buttonWork->get_active()) {
+    delete heatmap;
+    heatmap = NULL;
+  }
+  if (heatmap != NULL) {
+    delete _heatmap;
+    _heatmap = heatmap;
+  }
+  _buttonCancel->set_sensitive(busy);
+
+  RgbPixel white, black;
+  white.r = white.g = white.b = 0xff;
+  if (!results.empty()) mark_seam(white);
+  for (ResultQueue::iterator i = results.begin(); i != results.end(); ++i) {
+    removeSeam(*_currentFrame, i->seam, i->pixels);
+    // the rest of the debug frame is white, so it only needs shrinking
+    if (i->seam.direction == FLOW_LEFT_RIGHT) {
+      _debugFrame->w--;
+    } else {
+      _debugFrame->h--;
+    }
+  }
+  if (!results.empty()) {
+    _lastSeam = results.back().seam;
+    mark_seam(black);
+  }
+  for (ResultQueue::iterator i = results.begin(); i != results.end(); ++i) {
+    _history.push_back(move(*i));
+  }
+  // done or cancelled, so the full size frame is what to show; the proxy
+  // starts again from it, as it drifts from the exact seams
+  if (!busy) {
+    _targetW = _currentFrame->w;
+    _targetH = _currentFrame->h;
+    make_proxy();
+    _proxyStale = false;
+    _buttonUndo->set_sensitive(!_history.empty());
+    _buttonRedo->set_sensitive(!_redo.empty());
+    reset_ahead();
+  } else if (results.empty()) {
+    return;
+  }
+  update();
+}
+
+/* With _mutex held: a new start, or a seam of the current one left to
+   carve and the slider near enough to the last one */
+bool ImageCarver::ahead_pending() {
+  if (_aheadEnergy != NULL) return true;
+  if (_aheadState == NULL || _aheadStateGen != _aheadGen ||
+      _aheadCarved >= _aheadLimit) {
+    return false;
+  }
+  const Frame<PixelValue>& energy = *_aheadState->energy;
+  return (_aheadDirection == FLOW_LEFT_RIGHT) ? energy.w > 1 : energy.h > 1;
+}
+
+/* Runs on the worker thread between jobs, with lock held: carves one seam
+   ahead and posts it through _aheadDispatcher. A reset cancels it. */
+void ImageCarver::carve_ahead(std::unique_lock<std::mutex>& lock) {
+  if (_aheadEnergy != NULL) {
+    delete _aheadState;
+    const Frame<PixelValue>& energy = *_aheadEnergy;
+    _aheadState = getNewFlowState(_aheadEnergy);
+    _aheadEnergy = NULL;
+    _aheadStateGen = _aheadGen;
+
+    bool rows = (_aheadDirection == FLOW_LEFT_RIGHT);
+    _aheadIndex.assign(rows ? energy.h : energy.w, vector<unsigned>());
+    for (size_t i = 0; i < _aheadIndex.size(); i++) {
+      vector<unsigned>& line = _aheadIndex[i];
+      line.resize(rows ? energy.w : energy.h);
+      for (size_t j = 0; j < line.size(); j++) {
+        line[j] = rows ? j + i * energy.w : i + j * energy.w;
       }
     }
   }
-  return result;
+  FlowState& state = *_aheadState;
+  FlowDirection direction = _aheadDirection;
+  unsigned gen = _aheadGen;
+  state.cancelled = false;
+  lock.unlock();
+
+  AheadSeam ahead;
+  state.calcMaxFlow(direction);
+  if (!state.cancelled) {
+    state.cutEnergy(ahead.seam);
+    const vector<size_t>& pos = ahead.seam.positions;
+    ahead.pixels.resize(pos.size());
+    for (size_t i = 0; i < pos.size(); i++) {
+      vector<unsigned>& line = _aheadIndex[i];
+      ahead.pixels[i] = line[pos[i]];
+      line.erase(line.begin() + pos[i]);
+    }
+  }
+
+  lock.lock();
+  if (!state.cancelled && gen == _aheadGen) {
+    _aheadCarved++;
+    _aheadResults.push_back(move(ahead));
+    _aheadDispatcher.emit();
+  }
+}
+
+// Runs on the UI thread; the slider may go as far as has been carved
+void ImageCarver::ahead_done() {
+  AheadQueue ahead;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ahead.swap(_aheadResults);
+  }
+  if (ahead.empty()) return;
+  for (AheadQueue::iterator i = ahead.begin(); i != ahead.end(); ++i) {
+    unsigned step = _aheadSeams.size();
+    for (size_t j = 0; j < i->pixels.size(); j++) {
+      _order[i->pixels[j]] = step;
+    }
+    _aheadSeams.push_back(move(i->seam));
+  }
+  _sizeSlider->set_fill_level(_aheadSeams.size());
+}
+
+// The pixbuf shares frame's memory, so frame must outlive it
+Glib::RefPtr<Gdk::Pixbuf> ImageCarver::pixbuf_from_frame (Frame<RgbPixel>* frame) {
+  return Gdk::Pixbuf::create_from_data(
+    reinterpret_cast<const guint8*>(&frame->values[0]),
+    Gdk::COLORSPACE_RGB, false, 8, frame->w, frame->h,
+    frame->stride * sizeof(RgbPixel));
 }
 
 ImageCarverApplication::ImageCarverApplication() : Gtk::Application(app_id,
@@ -162,10 +763,16 @@ Glib::RefPtr<ImageCarverApplication> ImageCarverApplication::create() {
 }
 
 void ImageCarverApplication::create_window(const Glib::RefPtr<Gio::File>& file) {
+  FrameWrapper frame;
+  if (!readPnm(file->get_path(), frame)) {
+    cerr << "Failed to load " << file->get_path() << "\n";
+    return;
+  }
+
   ImageCarver *car = new ImageCarver();
   add_window(*car);
 
-  car->setFrame(readPnm(file->get_path()));
+  car->setFrame(move(frame));
 
   car->show();
 }
@@ -25,6 +25,11 @@
 #include <gtkmm.h>
 #include <iostream>
 #include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "frame.h"
 #include "energy.h"
@@ -35,23 +40,144 @@ public:
 
   virtual ~ImageCarver();
 
-  void setFrame(FrameWrapper* frame);
+  void setFrame(FrameWrapper&& frame);
 
   void do_carve(FlowDirection direction);
 private:
-  static Glib::RefPtr<Gdk::Pixbuf> pixbuf_from_frame (FrameWrapper* frame);
+  // Consecutive clicks in one direction are merged into one job
+  struct CarveJob {
+    FlowDirection direction;
+    std::size_t count;
+  };
+  typedef std::deque<CarveJob> JobQueue;
+
+  // A removed seam and what it took out of each frame, to put it back
+  struct SeamRecord {
+    Seam seam;
+    std::vector<RgbPixel> pixels;
+    std::vector<PixelValue> energy;
+  };
+  typedef std::deque<SeamRecord> ResultQueue;
+  typedef std::vector<SeamRecord> SeamStack;
+
+  /* A seam the worker carved ahead of the current size while idle, and
+     the offsets (x + y * w) in _currentFrame of the pixels it takes out */
+  struct AheadSeam {
+    Seam seam;
+    std::vector<unsigned> pixels;
+  };
+  typedef std::deque<AheadSeam> AheadQueue;
+
+  static Glib::RefPtr<Gdk::Pixbuf> pixbuf_from_frame (Frame<RgbPixel>* frame);
 
   void button_h_clicked();
   void button_v_clicked();
+  void button_cancel_clicked();
+  void button_undo_clicked();
+  void button_redo_clicked();
+  bool worker_idle();
+  void history_changed();
+  void work_changed();
+  void slider_changed();
+  Glib::ustring slider_format(double value);
+  void size_axis_changed();
+  bool apply_slider();
+  void reset_ahead();
   void update();
+  void mark_seam(const RgbPixel& value);
+  void make_proxy();
+  void carve_proxy();
 
+  void start_worker();
+  void stop_worker();
+  void worker_run();
+  void worker_done();
+  bool ahead_pending();
+  void carve_ahead(std::unique_lock<std::mutex>& lock);
+  void ahead_done();
 
 protected:
   Gtk::Image _image, _debugImage;
+  Gtk::Button* _buttonCancel;
+  Gtk::Button* _buttonUndo;
+  Gtk::Button* _buttonRedo;
+  // Shows the work of the last max flow in the debug pane instead
+  Gtk::ToggleButton* _buttonWork;
+  Gtk::ComboBoxText* _workCounter;
+  // Seams to take out of the current size, and whether of the width
+  Gtk::Scale* _sizeSlider;
+  Gtk::ComboBoxText* _sizeAxis;
+
+  // Kept in Gdk::Pixbuf row layout and wrapped without copying. Seams
+  // are removed in place, so the stride stays that of the loaded image.
+  Frame<RgbPixel>* _currentFrame;
+  Frame<RgbPixel>* _debugFrame;
+  Seam _lastSeam;
+  // Of the last max flow while _buttonWork was active, else NULL
+  Frame<RgbPixel>* _heatmap;
+
+  // Size _currentFrame will have once the worker has done every click
+  std::size_t _targetW, _targetH;
+  /* _currentFrame shrunk _proxyScale times, for images above
+     PREVIEW_MAX_PIXELS, else NULL. Clicks are carved on it at once, and
+     it is shown at the target size until the worker is done. */
+  Frame<RgbPixel>* _proxyFrame;
+  FlowState* _proxyState;
+  std::size_t _proxyScale;
+  // set by undo and redo; the proxy is made again on the next click
+  bool _proxyStale;
 
-  FrameWrapper* _currentFrame;
-  FrameWrapper* _debugFrame;
+  // Seams removed from _currentFrame, the last one on top, and the ones
+  // undone since the last carve
+  SeamStack _history;
+  SeamStack _redo;
+
+  /* Seams carved ahead, in order, in _sliderDirection. _order has the
+     step that removes each pixel of _currentFrame, or UINT_MAX. The
+     slider shows the first _sliderCount of them in _sliderFrame; they
+     are applied to _currentFrame by the next action. */
+  std::vector<Seam> _aheadSeams;
+  std::vector<unsigned> _order;
+  FlowDirection _sliderDirection;
+  unsigned _sliderCount;
+  Frame<RgbPixel>* _sliderFrame;
+
+  // Everything below is shared with the worker thread; _state is only
+  // touched by the worker while it is running. The worker only cuts the
+  // energy, the frames above are cut from the seams it posts.
   FlowState* _state;
+
+  std::thread _worker;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  JobQueue _jobs;
+  bool _busy;
+  bool _quit;
+  // Read by the worker at the start of each job
+  bool _countWork;
+  WorkCounter _counter;
+
+  // Seams posted by the worker, picked up by worker_done
+  Glib::Dispatcher _dispatcher;
+  ResultQueue _results;
+  Frame<RgbPixel>* _resultHeatmap;
+
+  /* Carving ahead, when there is no job. _aheadEnergy is a copy of the
+     energy to start from, taken by the worker; every reset bumps
+     _aheadGen, and seams of an older generation are dropped. */
+  Frame<PixelValue>* _aheadEnergy;
+  FlowDirection _aheadDirection;
+  unsigned _aheadGen;
+  Glib::Dispatcher _aheadDispatcher;
+  AheadQueue _aheadResults;
+  // Seams of this generation carved, and how many to carve before waiting
+  unsigned _aheadCarved;
+  unsigned _aheadLimit;
+  // Only replaced by the worker, under _mutex; the rest is its own
+  FlowState* _aheadState;
+  unsigned _aheadStateGen;
+  // Offsets in the start frame of what is left of each row (or column)
+  std::vector<std::vector<unsigned> > _aheadIndex;
 };
 
 class ImageCarverApplication : public Gtk::Application {
@@ -23,14 +23,35 @@
 #define _POINT_H
 
 #include <cstddef>
-#include <vector>
 
 #include "energy.h"
+#include "storage.h"
 
 struct Point {
 public:
-  // Only ever create at beginning. After that only iterate.
-  typedef std::vector<Point*> NeighborSet;
+  /* A run of FlowState::neighbors, whose room buildGraph reserves. Only
+     ever create at beginning. After that only iterate. */
+  struct NeighborSet {
+    typedef Point** iterator;
+    typedef Point* const* const_iterator;
+
+    Point** first;
+    Point** last;
+
+    NeighborSet() : first(NULL), last(NULL) { }
+
+    // empty, filled from slots on
+    void start(Point** slots) { first = last = slots; }
+    void push_back(Point* p) { *last++ = p; }
+
+    iterator begin() { return first; }
+    iterator end() { return last; }
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+    std::size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    Point* front() const { return *first; }
+  };
 
   enum Tree {
     TREE_NONE,
@@ -35,7 +35,9 @@ FlowState::EnergyType PushRelabelFlowState::calcMaxFlow(FlowDirection direction)
   s.dist = t.dist = 0;
 
   points.clear();
-  points.resize(energy->h * energy->w);
+  points.resize(getNumPoints(*this));
+  // counts nothing yet, but keeps work the size of points
+  resetWork();
 
   if (direction == FLOW_LEFT_RIGHT) {
     buildGraph<FLOW_LEFT_RIGHT>(*this);
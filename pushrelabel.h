@@ -32,15 +32,18 @@ class PushRelabelFlowState : public FlowState {
 public:
   // operations: add, remove something deque clearly faster
   // queue much faster than stack (algorithmically)
-  typedef std::queue<Point*, std::deque<Point*> > ActiveSet;
+  typedef std::deque<Point*, CountingAllocator<Point*, MEMORY_QUEUES> >
+    QueueSet;
+  typedef std::queue<Point*, QueueSet> ActiveSet;
   // operators: add, remove something deque clearly faster than list
   // potential (small) speedup from using a vector with a large reserved size.
-  typedef std::stack<Point*, std::deque<Point*> > OrphanSet;
+  typedef std::stack<Point*, QueueSet> OrphanSet;
 
   ActiveSet A;
   OrphanSet O;
 
-  PushRelabelFlowState(FrameWrapper& frame) : FlowState(frame) { }
+  PushRelabelFlowState(const FrameWrapper& frame) : FlowState(frame) { }
+  PushRelabelFlowState(Frame<PixelValue>* energy) : FlowState(energy) { }
 
   virtual EnergyType calcMaxFlow(FlowDirection direction);
 
@@ -0,0 +1,230 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "region.h"
+
+#include <thread>
+
+#include "const.h"
+#include "trace.h"
+
+using namespace std;
+
+typedef RegionFlowState::Band Band;
+typedef RegionFlowState::BandSet BandSet;
+
+// Copy of the energy of rows (or columns) [from, to)
+static Frame<PixelValue>* getBand(const Frame<PixelValue>& energy,
+                                  FlowDirection direction,
+                                  size_t from, size_t to) {
+  Frame<PixelValue>* band;
+  if (direction == FLOW_LEFT_RIGHT) {
+    band = new Frame<PixelValue>(energy.w, to - from);
+    for (size_t y = from; y < to; y++) {
+      for (size_t x = 0; x < energy.w; x++) {
+        band->values[x + (y - from) * band->stride] =
+          energy.values[x + y * energy.stride];
+      }
+    }
+  } else {
+    band = new Frame<PixelValue>(to - from, energy.h);
+    for (size_t y = 0; y < energy.h; y++) {
+      for (size_t x = from; x < to; x++) {
+        band->values[(x - from) + y * band->stride] =
+          energy.values[x + y * energy.stride];
+      }
+    }
+  }
+  return band;
+}
+
+/* Adds the flow, and the work counted, of a solved band to state, whose
+   first row (or column) is origin */
+static void addFlow(FlowState& state, size_t origin, const Band& band) {
+  const FlowState& part = *band.state;
+  const Frame<PixelValue>& energy = *part.energy;
+  bool rows = (state.direction == FLOW_LEFT_RIGHT);
+  size_t at = band.from - origin;
+  for (size_t y = 0; y < energy.h; y++) {
+    for (size_t x = 0; x < energy.w; x++) {
+      size_t o = rows ? getOff(state, x, y + at) :
+                        getOff(state, x + at, y);
+      size_t po = getOff(part, x, y);
+      state.points[o].flow = part.points[po].flow;
+      if (state.countWork) {
+        for (size_t i = 0; i < NUM_WORK_COUNTERS; i++) {
+          state.work[i][o] += part.work[i][po];
+        }
+      }
+    }
+  }
+  state.s.flow += part.s.flow;
+}
+
+static void solveBand(Band& band, FlowDirection direction) {
+  band.state->calcMaxFlow(direction);
+}
+
+// Solves the union of a and b, then frees them
+static void mergeBands(Band& merged, Band& a, Band& b,
+                       FlowDirection direction) {
+  TraceScope trace("mergeBands");
+  // out of time: left approximate, without building the merged graph
+  if (merged.state->startWithinBudget(direction)) {
+    merged.state->prepare(direction);
+    addFlow(*merged.state, merged.from, a);
+    addFlow(*merged.state, merged.from, b);
+    merged.state->solve();
+  }
+  delete a.state;
+  delete b.state;
+}
+
+static Band newBand(const RegionFlowState& state, size_t from, size_t to) {
+  Band band;
+  band.from = from;
+  band.to = to;
+  band.state = new EdmondsKarpFlowState(
+    getBand(*state.energy, state.direction, from, to));
+  band.state->layout = state.layout;
+  band.state->deadline = state.deadline;
+  band.state->scaling = state.scaling;
+  band.state->countWork = state.countWork;
+  band.state->cancelled = state.cancelled.load();
+  return band;
+}
+
+static void freeBands(BandSet& bands) {
+  for (BandSet::iterator i = bands.begin(); i != bands.end(); ++i) {
+    delete i->state;
+  }
+  bands.clear();
+}
+
+/* After a round of band solves. False, with the bands freed and state
+   approximate, if a band or state ran out of time. */
+static bool bandsWithinBudget(RegionFlowState& state, BandSet& bands) {
+  FlowState::EnergyType flow = 0;
+  bool stopped = false;
+  for (BandSet::iterator i = bands.begin(); i != bands.end(); ++i) {
+    flow += i->state->s.flow;
+    stopped = stopped || i->state->approximate;
+  }
+  if (!state.withinBudget(flow) || stopped) {
+    state.approximate = true;
+    freeBands(bands);
+    return false;
+  }
+  return true;
+}
+
+// The bands that cancel() reaches; empty clears them
+void RegionFlowState::setRunning(const BandSet& bands) {
+  lock_guard<mutex> lock(runningMutex);
+  running.clear();
+  for (BandSet::const_iterator i = bands.begin(); i != bands.end(); ++i) {
+    running.push_back(i->state);
+    // cancelled after the band was made
+    if (cancelled) i->state->cancel();
+  }
+}
+
+void RegionFlowState::cancel() {
+  FlowState::cancel();
+  lock_guard<mutex> lock(runningMutex);
+  for (size_t i = 0; i < running.size(); i++) {
+    running[i]->cancel();
+  }
+}
+
+FlowState::EnergyType RegionFlowState::calcMaxFlow(FlowDirection direction) {
+  if (!startWithinBudget(direction)) return 0;
+
+  size_t extent = (direction == FLOW_LEFT_RIGHT) ? energy->h : energy->w;
+  size_t n = regions;
+  if (n == 0) {
+    n = thread::hardware_concurrency();
+  }
+  if (n > extent / REGION_MIN_SIZE) {
+    n = extent / REGION_MIN_SIZE;
+  }
+  if (n < 2) {
+    return EdmondsKarpFlowState::calcMaxFlow(direction);
+  }
+
+  // the last graph is rebuilt at the end, so don't hold on to it meanwhile
+  PointsSet().swap(points);
+  NeighborsSet().swap(neighbors);
+
+  BandSet bands;
+  for (size_t i = 0; i < n; i++) {
+    bands.push_back(newBand(*this, extent * i / n, extent * (i + 1) / n));
+  }
+
+  setRunning(bands);
+  vector<thread> workers;
+  for (BandSet::iterator i = bands.begin(); i != bands.end(); ++i) {
+    workers.push_back(thread(solveBand, ref(*i), direction));
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  setRunning(BandSet());
+  if (!bandsWithinBudget(*this, bands)) return 0;
+
+  // merge neighbors until two are left; an odd band waits a level
+  while (bands.size() > 2) {
+    if (cancelled) {
+      freeBands(bands);
+      return 0;
+    }
+    BandSet merged;
+    for (size_t i = 0; i + 1 < bands.size(); i += 2) {
+      merged.push_back(newBand(*this, bands[i].from, bands[i + 1].to));
+    }
+    setRunning(merged);
+    workers.clear();
+    for (size_t i = 0; i < merged.size(); i++) {
+      workers.push_back(thread(mergeBands, ref(merged[i]), ref(bands[2 * i]),
+                               ref(bands[2 * i + 1]), direction));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+      workers[i].join();
+    }
+    setRunning(BandSet());
+    if (bands.size() % 2) {
+      merged.push_back(bands.back());
+    }
+    bands.swap(merged);
+    if (!bandsWithinBudget(*this, bands)) return 0;
+  }
+
+  if (!startWithinBudget(direction)) {
+    freeBands(bands);
+    return 0;
+  }
+  prepare(direction);
+  for (BandSet::iterator i = bands.begin(); i != bands.end(); ++i) {
+    addFlow(*this, 0, *i);
+  }
+  freeBands(bands);
+  return solve();
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _REGIONENERGY_H
+#define _REGIONENERGY_H
+
+#include <vector>
+#include <mutex>
+
+#include "edmondskarp.h"
+
+/* Splits the graph into bands that each reach from s to t, so that they
+   are independent problems, and solves them on their own threads. Bands
+   are then merged pairwise, each merge starting from the flow its halves
+   already carry, until two are left. Those are merged into the whole graph
+   and solved on the calling thread, which also holds the two meanwhile. */
+class RegionFlowState : public EdmondsKarpFlowState {
+public:
+  struct Band {
+    // rows (or columns) of the frame
+    std::size_t from;
+    std::size_t to;
+    EdmondsKarpFlowState* state;
+  };
+  typedef std::vector<Band> BandSet;
+
+  // bands to start with; 0 for one per core
+  std::size_t regions;
+
+  RegionFlowState(const FrameWrapper& frame) :
+    EdmondsKarpFlowState(frame), regions(0) { }
+  RegionFlowState(Frame<PixelValue>* energy) :
+    EdmondsKarpFlowState(energy), regions(0) { }
+
+  virtual EnergyType calcMaxFlow(FlowDirection direction);
+  // also stops the bands being solved
+  virtual void cancel();
+
+  virtual ~RegionFlowState() { }
+
+private:
+  void setRunning(const BandSet& bands);
+
+  // guards running
+  std::mutex runningMutex;
+  std::vector<FlowState*> running;
+};
+
+#endif
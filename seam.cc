@@ -0,0 +1,79 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "seam.h"
+
+#include <string>
+#include <sstream>
+
+using namespace std;
+
+static const char* getDirectionName(FlowDirection direction) {
+  return (direction == FLOW_LEFT_RIGHT) ? "lr" : "tb";
+}
+
+void printSeams(const SeamSet& seams, ostream& os) {
+  for (SeamSet::const_iterator i = seams.begin(); i != seams.end(); ++i) {
+    os << getDirectionName(i->direction) << "," << i->cost;
+    for (size_t j = 0; j < i->positions.size(); j++) {
+      os << "," << i->positions[j];
+    }
+    os << "\n";
+  }
+}
+
+bool loadSeams(istream& is, SeamSet& seams) {
+  string line;
+  while (getline(is, line)) {
+    if (line.empty()) continue;
+    istringstream fields(line);
+    string field;
+    Seam seam;
+    getline(fields, field, ',');
+    if (field == getDirectionName(FLOW_LEFT_RIGHT)) {
+      seam.direction = FLOW_LEFT_RIGHT;
+    } else if (field == getDirectionName(FLOW_TOP_BOTTOM)) {
+      seam.direction = FLOW_TOP_BOTTOM;
+    } else {
+      return false;
+    }
+    char comma;
+    if (!(fields >> seam.cost)) return false;
+    size_t position;
+    while (fields >> comma >> position) {
+      if (comma != ',') return false;
+      seam.positions.push_back(position);
+    }
+    if (!fields.eof()) return false;
+    seams.push_back(seam);
+  }
+  return true;
+}
+
+bool fitsFrame(const Seam& seam, size_t w, size_t h) {
+  size_t length = (seam.direction == FLOW_LEFT_RIGHT) ? h : w;
+  size_t across = (seam.direction == FLOW_LEFT_RIGHT) ? w : h;
+  if (seam.positions.size() != length || across < 2) return false;
+  for (size_t i = 0; i < length; i++) {
+    if (seam.positions[i] >= across) return false;
+  }
+  return true;
+}
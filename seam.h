@@ -0,0 +1,57 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _SEAM_H
+#define _SEAM_H
+
+#include <cstddef>
+#include <vector>
+#include <istream>
+#include <ostream>
+
+#include "const.h"
+
+// The pixels removed by one carve and the max flow that picked them
+struct Seam {
+  FlowDirection direction;
+  // Capacity of the cut: energy + 1 summed over the pixels removed
+  unsigned long cost;
+  // One coordinate per row for FLOW_LEFT_RIGHT, per column for
+  // FLOW_TOP_BOTTOM
+  std::vector<std::size_t> positions;
+  // The max flow ran out of time; the seam is the cheapest path instead
+  bool approximate;
+
+  Seam() : direction(FLOW_LEFT_RIGHT), cost(0), approximate(false) { }
+};
+
+typedef std::vector<Seam> SeamSet;
+
+/* One seam per line, in carving order: "lr" or "tb", the cost, then the
+   positions, all separated by commas. */
+void printSeams(const SeamSet& seams, std::ostream& os);
+// Appends the seams in is to seams. Returns false on a malformed line.
+bool loadSeams(std::istream& is, SeamSet& seams);
+
+// True if seam can be removed from a w x h frame
+bool fitsFrame(const Seam& seam, std::size_t w, std::size_t h);
+
+#endif
@@ -0,0 +1,126 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "speculative.h"
+
+#include <thread>
+
+#include "trace.h"
+
+using namespace std;
+
+SpeculativeFlowState::SpeculativeFlowState(Frame<PixelValue>* energy,
+                                           MaxFlowAlogorithm algorithm) :
+  FlowState(energy) {
+  states[FLOW_LEFT_RIGHT] = getNewFlowState(energy, algorithm);
+  states[FLOW_TOP_BOTTOM] = getNewFlowState(energy, algorithm);
+  solved = states[FLOW_LEFT_RIGHT];
+  haveCheaperSeam = false;
+}
+
+SpeculativeFlowState::~SpeculativeFlowState() {
+  for (size_t i = 0; i < 2; i++) {
+    states[i]->energy = NULL;
+    delete states[i];
+  }
+}
+
+// energy may have been replaced since the last solve
+void SpeculativeFlowState::share() {
+  for (size_t i = 0; i < 2; i++) {
+    states[i]->energy = energy;
+    states[i]->layout = layout;
+    states[i]->deadline = deadline;
+    states[i]->countWork = countWork;
+    states[i]->cancelled = cancelled.load();
+  }
+}
+
+void SpeculativeFlowState::setSolved(FlowState* state) {
+  solved = state;
+  direction = state->direction;
+  approximate = state->approximate;
+  s.flow = state->s.flow;
+}
+
+// The seam is found on the same thread, as it is what decides
+static void solveDirection(FlowState* state, FlowDirection direction,
+                           Seam* seam) {
+  state->calcMaxFlow(direction);
+  if (!state->cancelled) {
+    state->findSeam(*seam);
+  }
+}
+
+FlowDirection SpeculativeFlowState::calcCheaperFlow() {
+  TraceScope trace("calcCheaperFlow");
+  share();
+  for (size_t i = 0; i < 2; i++) {
+    states[i]->progress = ProgressCallback();
+  }
+  Seam found[2];
+  thread across(solveDirection, states[FLOW_LEFT_RIGHT], FLOW_LEFT_RIGHT,
+                &found[FLOW_LEFT_RIGHT]);
+  solveDirection(states[FLOW_TOP_BOTTOM], FLOW_TOP_BOTTOM,
+                 &found[FLOW_TOP_BOTTOM]);
+  across.join();
+
+  /* The loser keeps its nodes, so the next solve needs no allocation, but
+     not its trees: the cut shifts every node past the seam in the other
+     direction, and as flow on the infinite edges is not kept there is no
+     telling which of its paths are left. */
+  /* By the capacity of each cut: the flow a solver stops at may be far
+     short of it, and by different amounts in each direction */
+  FlowDirection cheaper =
+    (found[FLOW_TOP_BOTTOM].cost < found[FLOW_LEFT_RIGHT].cost) ?
+    FLOW_TOP_BOTTOM : FLOW_LEFT_RIGHT;
+  trace.addArg("direction", cheaper);
+  setSolved(states[cheaper]);
+  cheaperSeam = move(found[cheaper]);
+  haveCheaperSeam = !cancelled;
+  return cheaper;
+}
+
+FlowState::EnergyType SpeculativeFlowState::calcMaxFlow(
+    FlowDirection direction) {
+  share();
+  FlowState* state = states[direction];
+  state->progress = progress;
+  state->calcMaxFlow(direction);
+  setSolved(state);
+  haveCheaperSeam = false;
+  return s.flow;
+}
+
+void SpeculativeFlowState::findSeam(Seam& seam) const {
+  if (haveCheaperSeam) {
+    seam = cheaperSeam;
+  } else {
+    solved->findSeam(seam);
+  }
+}
+
+void SpeculativeFlowState::cancel() {
+  FlowState::cancel();
+  for (size_t i = 0; i < 2; i++) {
+    states[i]->cancel();
+  }
+}
@@ -0,0 +1,71 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _SPECULATIVE_H
+#define _SPECULATIVE_H
+
+#include "energy.h"
+
+/* Solves both directions of the same energy at once, each on its own
+   thread with its own nodes, and keeps the cheaper cut. The energy is
+   this state's; the two states it holds only read it while solving. */
+class SpeculativeFlowState : public FlowState {
+public:
+  // takes ownership of energy
+  SpeculativeFlowState(Frame<PixelValue>* energy,
+                       MaxFlowAlogorithm algorithm);
+
+  /* Solves both directions and returns the one whose seam has the
+     smaller Seam::cost, which is then what cutFrame cuts. Deadline is
+     passed on, progress is not called. */
+  FlowDirection calcCheaperFlow();
+
+  // Solves one direction on the state kept for it
+  virtual EnergyType calcMaxFlow(FlowDirection direction);
+
+  virtual void findSeam(Seam& seam) const;
+
+  virtual void cancel();
+
+  // For settings such as EdmondsKarpFlowState::scaling
+  FlowState& getState(FlowDirection direction) {
+    return *states[direction];
+  }
+  // The state of the last solve, e.g. for getWorkHeatmap
+  const FlowState& getSolved() const {
+    return *solved;
+  }
+
+  virtual ~SpeculativeFlowState();
+private:
+  // indexed by FlowDirection
+  FlowState* states[2];
+  FlowState* solved;
+  // Of the last calcCheaperFlow, until a calcMaxFlow
+  Seam cheaperSeam;
+  bool haveCheaperSeam;
+
+  // Hands energy and the settings to both states
+  void share();
+  void setSolved(FlowState* state);
+};
+
+#endif
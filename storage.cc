@@ -0,0 +1,413 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "storage.h"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "const.h"
+
+using namespace std;
+
+#define HUGE_PAGE_BYTES (2 << 20)
+// from <numaif.h>, which is not always installed
+#define STORAGE_MPOL_PREFERRED 1
+
+enum MappingKind {
+  MAPPING_FILE,
+  MAPPING_ANONYMOUS,
+  MAPPING_HUGEPAGE,
+  MAPPING_HUGETLB
+};
+
+struct Mapping {
+  // what was asked for; the mapping itself may be rounded up
+  size_t bytes;
+  size_t length;
+  MappingKind kind;
+};
+
+// start address -> mapping, for every buffer not from operator new
+typedef map<const char*, Mapping> MappingSet;
+
+static mutex storageMutex;
+static StorageMode mode = DEFAULT_STORAGE_MODE;
+static bool numaLocal = false;
+static size_t memoryCap = 0;
+static string directory;
+static MappingSet mappings;
+static atomic<size_t> numFileMappings(0);
+static StorageStats stats = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1 };
+
+void setStorageMode(StorageMode m) {
+  lock_guard<mutex> lock(storageMutex);
+  mode = m;
+}
+
+StorageMode getStorageMode() {
+  lock_guard<mutex> lock(storageMutex);
+  return mode;
+}
+
+const char* getStorageModeName(StorageMode m) {
+  switch (m) {
+  case STORAGE_HEAP:
+    return "heap";
+  case STORAGE_MAPPED:
+    return "mapped";
+  case STORAGE_HUGEPAGE:
+    return "thp";
+  case STORAGE_HUGETLB:
+    return "hugetlb";
+  default:
+    return "unknown";
+  }
+}
+
+bool parseStorageMode(const string& name, StorageMode& m) {
+  const StorageMode all[] = { STORAGE_HEAP, STORAGE_MAPPED, STORAGE_HUGEPAGE,
+                              STORAGE_HUGETLB };
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+    if (name == getStorageModeName(all[i])) {
+      m = all[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+void setStorageNumaLocal(bool local) {
+  lock_guard<mutex> lock(storageMutex);
+  numaLocal = local;
+}
+
+bool getStorageNumaLocal() {
+  lock_guard<mutex> lock(storageMutex);
+  return numaLocal;
+}
+
+void setStorageMemoryCap(size_t cap) {
+  lock_guard<mutex> lock(storageMutex);
+  memoryCap = cap;
+}
+
+size_t getStorageMemoryCap() {
+  lock_guard<mutex> lock(storageMutex);
+  return memoryCap;
+}
+
+void setStorageDirectory(const string& dir) {
+  lock_guard<mutex> lock(storageMutex);
+  directory = dir;
+}
+
+StorageStats getStorageStats() {
+  lock_guard<mutex> lock(storageMutex);
+  return stats;
+}
+
+static string getDirectory() {
+  if (!directory.empty()) return directory;
+  const char* tmp = getenv("TMPDIR");
+  return (tmp != NULL && *tmp) ? tmp : "/tmp";
+}
+
+/* Maps an unlinked temporary file, so the kernel can write pages back
+   instead of keeping them resident. NULL on failure. */
+static void* mapFile(Mapping& m) {
+  string name = getDirectory() + "/carver-XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0) return NULL;
+  unlink(name.c_str());
+  void* p = MAP_FAILED;
+  if (ftruncate(fd, m.bytes) == 0) {
+    p = mmap(NULL, m.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  m.length = m.bytes;
+  m.kind = MAPPING_FILE;
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void* mapAnonymous(Mapping& m) {
+  void* p = mmap(NULL, m.bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  m.length = m.bytes;
+  m.kind = MAPPING_ANONYMOUS;
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+static size_t roundHuge(size_t bytes) {
+  return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+}
+
+/* Over-allocates by one huge page and trims, so that the buffer starts on
+   a huge page boundary and khugepaged can back all of it. */
+static void* mapHugePage(Mapping& m) {
+  size_t length = roundHuge(m.bytes);
+  void* p = mmap(NULL, length + HUGE_PAGE_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  char* raw = static_cast<char*>(p);
+  char* aligned =
+    reinterpret_cast<char*>(roundHuge(reinterpret_cast<size_t>(raw)));
+  if (aligned > raw) {
+    munmap(raw, aligned - raw);
+  }
+  size_t tail = (raw + length + HUGE_PAGE_BYTES) - (aligned + length);
+  if (tail > 0) {
+    munmap(aligned + length, tail);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+  m.length = length;
+  m.kind = MAPPING_HUGEPAGE;
+  return aligned;
+}
+
+static void* mapHugeTlb(Mapping& m) {
+#ifdef MAP_HUGETLB
+  size_t length = roundHuge(m.bytes);
+  void* p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  m.length = length;
+  m.kind = MAPPING_HUGETLB;
+  return p;
+#else
+  (void)m;
+  return NULL;
+#endif
+}
+
+// Prefers the calling thread's node for p. Returns the node, or -1.
+static int bindLocal(void* p, const Mapping& m) {
+  unsigned int cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return -1;
+  const size_t bits = 8 * sizeof(unsigned long);
+  unsigned long mask[1024 / bits] = { 0 };
+  if (node >= 1024) return -1;
+  mask[node / bits] = 1UL << (node % bits);
+  if (syscall(SYS_mbind, p, m.length, STORAGE_MPOL_PREFERRED, mask,
+              (unsigned long)1024 + 1, 0) != 0) {
+    return -1;
+  }
+  return node;
+}
+
+static void addBytes(size_t& bytes, size_t& peak, size_t n) {
+  bytes += n;
+  if (bytes > peak) {
+    peak = bytes;
+  }
+}
+
+static atomic<size_t> memoryBytes[NUM_MEMORY_CATEGORIES];
+static atomic<size_t> peakMemoryBytes[NUM_MEMORY_CATEGORIES];
+static atomic<size_t> totalMemoryBytes(0);
+static atomic<size_t> peakTotalMemoryBytes(0);
+static atomic<bool> memoryCounting(false);
+
+const char* getMemoryCategoryName(MemoryCategory category) {
+  switch (category) {
+  case MEMORY_FRAMES:
+    return "frames";
+  case MEMORY_POINTS:
+    return "points";
+  case MEMORY_NEIGHBORS:
+    return "neighbors";
+  case MEMORY_QUEUES:
+    return "queues";
+  case MEMORY_PATHS:
+    return "paths";
+  default:
+    return "unknown";
+  }
+}
+
+MemoryUsage getMemoryUsage() {
+  MemoryUsage usage;
+  for (size_t i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    usage.bytes[i] = memoryBytes[i];
+    usage.peakBytes[i] = peakMemoryBytes[i];
+  }
+  usage.totalBytes = totalMemoryBytes;
+  usage.peakTotalBytes = peakTotalMemoryBytes;
+  return usage;
+}
+
+void resetMemoryPeaks() {
+  for (size_t i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    peakMemoryBytes[i] = memoryBytes[i].load();
+  }
+  peakTotalMemoryBytes = totalMemoryBytes.load();
+}
+
+void setMemoryCounting(bool on) {
+  memoryCounting = on;
+}
+
+bool getMemoryCounting() {
+  return memoryCounting;
+}
+
+static void raisePeak(atomic<size_t>& peak, size_t bytes) {
+  size_t old = peak.load(memory_order_relaxed);
+  while (bytes > old &&
+         !peak.compare_exchange_weak(old, bytes, memory_order_relaxed)) { }
+}
+
+void addMemory(MemoryCategory category, size_t bytes) {
+  if (!memoryCounting.load(memory_order_relaxed)) return;
+  size_t now = memoryBytes[category].fetch_add(bytes, memory_order_relaxed);
+  raisePeak(peakMemoryBytes[category], now + bytes);
+  now = totalMemoryBytes.fetch_add(bytes, memory_order_relaxed);
+  raisePeak(peakTotalMemoryBytes, now + bytes);
+}
+
+void removeMemory(MemoryCategory category, size_t bytes) {
+  if (!memoryCounting.load(memory_order_relaxed)) return;
+  memoryBytes[category].fetch_sub(bytes, memory_order_relaxed);
+  totalMemoryBytes.fetch_sub(bytes, memory_order_relaxed);
+}
+
+void* allocateStorage(size_t bytes) {
+  if (bytes >= STORAGE_MIN_MAPPED_BYTES) {
+    lock_guard<mutex> lock(storageMutex);
+    Mapping m;
+    m.bytes = bytes;
+    void* p = NULL;
+    switch (mode) {
+    case STORAGE_MAPPED:
+      if (memoryCap == 0 || stats.heapBytes + bytes > memoryCap) {
+        p = mapFile(m);
+      }
+      break;
+    case STORAGE_HUGETLB:
+      p = mapHugeTlb(m);
+      if (p != NULL) break;
+      // no pages left in the pool
+      stats.hugetlbFallbacks++;
+      // fall through
+    case STORAGE_HUGEPAGE:
+      p = mapHugePage(m);
+      break;
+    default:
+      break;
+    }
+    if (p == NULL && numaLocal) {
+      p = mapAnonymous(m);
+    }
+
+    if (p != NULL) {
+      if (numaLocal) {
+        int node = bindLocal(p, m);
+        if (node >= 0) {
+          stats.numaBuffers++;
+          stats.numaNode = node;
+        }
+      }
+      mappings[static_cast<const char*>(p)] = m;
+      switch (m.kind) {
+      case MAPPING_FILE:
+        numFileMappings++;
+        stats.mappedBuffers++;
+        addBytes(stats.mappedBytes, stats.peakMappedBytes, bytes);
+        break;
+      case MAPPING_HUGETLB:
+        stats.hugetlbBuffers++;
+        // fall through
+      case MAPPING_HUGEPAGE:
+        stats.hugeBuffers++;
+        addBytes(stats.hugeBytes, stats.peakHugeBytes, bytes);
+        break;
+      case MAPPING_ANONYMOUS:
+        addBytes(stats.heapBytes, stats.peakHeapBytes, bytes);
+        break;
+      }
+      return p;
+    }
+
+    // nothing special requested, or the mapping failed
+    addBytes(stats.heapBytes, stats.peakHeapBytes, bytes);
+  }
+  return ::operator new(bytes);
+}
+
+void freeStorage(void* p, size_t bytes) {
+  if (p == NULL) return;
+  if (bytes >= STORAGE_MIN_MAPPED_BYTES) {
+    lock_guard<mutex> lock(storageMutex);
+    MappingSet::iterator i = mappings.find(static_cast<const char*>(p));
+    if (i != mappings.end()) {
+      const Mapping& m = i->second;
+      munmap(p, m.length);
+      switch (m.kind) {
+      case MAPPING_FILE:
+        stats.mappedBytes -= m.bytes;
+        numFileMappings--;
+        break;
+      case MAPPING_HUGEPAGE:
+      case MAPPING_HUGETLB:
+        stats.hugeBytes -= m.bytes;
+        break;
+      case MAPPING_ANONYMOUS:
+        stats.heapBytes -= m.bytes;
+        break;
+      }
+      mappings.erase(i);
+      return;
+    }
+    stats.heapBytes -= bytes;
+  }
+  ::operator delete(p);
+}
+
+void releaseStorage(const void* p, size_t bytes) {
+  // common case: nothing is file backed
+  if (numFileMappings == 0 || bytes == 0) return;
+
+  const char* start = static_cast<const char*>(p);
+  lock_guard<mutex> lock(storageMutex);
+  MappingSet::iterator i = mappings.upper_bound(start);
+  if (i == mappings.begin()) return;
+  --i;
+  // dropping anonymous pages would lose their contents
+  if (i->second.kind != MAPPING_FILE) return;
+  const char* end = i->first + i->second.bytes;
+  if (start >= end) return;
+  if (start + bytes < end) end = start + bytes;
+
+  // madvise works on whole pages inside the range
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t from = (reinterpret_cast<size_t>(start) + page - 1) / page * page;
+  size_t to = reinterpret_cast<size_t>(end) / page * page;
+  if (to > from) {
+    madvise(reinterpret_cast<void*>(from), to - from, MADV_DONTNEED);
+  }
+}
@@ -0,0 +1,236 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include <cstddef>
+#include <string>
+#include <limits>
+#include <new>
+#include <utility>
+
+enum StorageMode {
+  // everything on the heap
+  STORAGE_HEAP,
+  // large buffers go to temporary files once the memory cap is reached
+  STORAGE_MAPPED,
+  // large buffers are 2 MiB aligned and madvise'd for transparent huge pages
+  STORAGE_HUGEPAGE,
+  // large buffers come from the hugetlbfs pool (MAP_HUGETLB); when the pool
+  // is empty they fall back to STORAGE_HUGEPAGE
+  STORAGE_HUGETLB
+};
+
+// What counted allocations are used for
+enum MemoryCategory {
+  // Frame values: images, energy and cut masks
+  MEMORY_FRAMES,
+  // FlowState::points
+  MEMORY_POINTS,
+  // FlowState::neighbors, which Point::to and Point::from point into
+  MEMORY_NEIGHBORS,
+  // active, orphan and layer queues of the solvers
+  MEMORY_QUEUES,
+  // augmenting paths
+  MEMORY_PATHS,
+  NUM_MEMORY_CATEGORIES
+};
+
+struct MemoryUsage {
+  std::size_t bytes[NUM_MEMORY_CATEGORIES];
+  std::size_t peakBytes[NUM_MEMORY_CATEGORIES];
+  // of all categories together
+  std::size_t totalBytes;
+  std::size_t peakTotalBytes;
+};
+
+struct StorageStats {
+  // Everything below counts large buffers only
+  std::size_t heapBytes;
+  std::size_t mappedBytes;
+  std::size_t hugeBytes;
+  std::size_t peakHeapBytes;
+  std::size_t peakMappedBytes;
+  std::size_t peakHugeBytes;
+  std::size_t mappedBuffers;
+  std::size_t hugeBuffers;
+  std::size_t hugetlbBuffers;
+  std::size_t hugetlbFallbacks;
+  // buffers placed on the allocating thread's node, and the last such node
+  std::size_t numaBuffers;
+  int numaNode;
+};
+
+void setStorageMode(StorageMode mode);
+StorageMode getStorageMode();
+const char* getStorageModeName(StorageMode mode);
+// Parses the names returned by getStorageModeName
+bool parseStorageMode(const std::string& name, StorageMode& mode);
+
+/* Place large buffers on the NUMA node of the thread that allocates them,
+   i.e. the thread doing the carving. Heap buffers are switched to
+   anonymous mappings so that they can be bound. */
+void setStorageNumaLocal(bool local);
+bool getStorageNumaLocal();
+
+/* In STORAGE_MAPPED mode large buffers stay on the heap while the heap
+   total is under cap; the rest are file backed. 0 maps every large
+   buffer. */
+void setStorageMemoryCap(std::size_t cap);
+std::size_t getStorageMemoryCap();
+
+// Where backing files are created (default: $TMPDIR or /tmp)
+void setStorageDirectory(const std::string& dir);
+
+StorageStats getStorageStats();
+
+void* allocateStorage(std::size_t bytes);
+void freeStorage(void* p, std::size_t bytes);
+
+const char* getMemoryCategoryName(MemoryCategory category);
+// Bytes held by the counting allocators, with high-water marks
+MemoryUsage getMemoryUsage();
+// Starts the high-water marks again from the current usage
+void resetMemoryPeaks();
+/* Counting is off by default, as the atomics cost the solvers on every
+   allocation. Switch it on before the buffers to be counted are made, and
+   leave it on. */
+void setMemoryCounting(bool on);
+bool getMemoryCounting();
+void addMemory(MemoryCategory category, std::size_t bytes);
+void removeMemory(MemoryCategory category, std::size_t bytes);
+
+/* Hint that [p, p+bytes) is not needed for a while. Pages of file backed
+   buffers are dropped from memory, and the contents are kept in the file.
+   Does nothing for heap buffers. */
+void releaseStorage(const void* p, std::size_t bytes);
+
+// Allocator for the large containers (frame values, solver points and
+// neighbors)
+template<typename T, MemoryCategory C = MEMORY_FRAMES>
+struct StorageAllocator {
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template<typename U> struct rebind {
+    typedef StorageAllocator<U, C> other;
+  };
+
+  StorageAllocator() { }
+  template<typename U> StorageAllocator(const StorageAllocator<U, C>&) { }
+
+  T* allocate(std::size_t n) {
+    addMemory(C, n * sizeof(T));
+    return static_cast<T*>(allocateStorage(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    removeMemory(C, n * sizeof(T));
+    freeStorage(p, n * sizeof(T));
+  }
+
+  std::size_t max_size() const {
+    return std::numeric_limits<std::size_t>::max() / sizeof(T);
+  }
+
+  template<typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new((void*)p) U(std::forward<Args>(args)...);
+  }
+
+  template<typename U>
+  void destroy(U* p) {
+    p->~U();
+  }
+};
+
+template<typename T, typename U, MemoryCategory C>
+bool operator==(const StorageAllocator<T, C>&, const StorageAllocator<U, C>&) {
+  return true;
+}
+
+template<typename T, typename U, MemoryCategory C>
+bool operator!=(const StorageAllocator<T, C>&, const StorageAllocator<U, C>&) {
+  return false;
+}
+
+// Plain heap allocator that counts its bytes under C
+template<typename T, MemoryCategory C>
+struct CountingAllocator {
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template<typename U> struct rebind {
+    typedef CountingAllocator<U, C> other;
+  };
+
+  CountingAllocator() { }
+  template<typename U> CountingAllocator(const CountingAllocator<U, C>&) { }
+
+  T* allocate(std::size_t n) {
+    addMemory(C, n * sizeof(T));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    removeMemory(C, n * sizeof(T));
+    ::operator delete(p);
+  }
+
+  std::size_t max_size() const {
+    return std::numeric_limits<std::size_t>::max() / sizeof(T);
+  }
+
+  template<typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new((void*)p) U(std::forward<Args>(args)...);
+  }
+
+  template<typename U>
+  void destroy(U* p) {
+    p->~U();
+  }
+};
+
+template<typename T, typename U, MemoryCategory C>
+bool operator==(const CountingAllocator<T, C>&,
+                const CountingAllocator<U, C>&) {
+  return true;
+}
+
+template<typename T, typename U, MemoryCategory C>
+bool operator!=(const CountingAllocator<T, C>&,
+                const CountingAllocator<U, C>&) {
+  return false;
+}
+
+#endif
@@ -22,11 +22,20 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
 #include <getopt.h>
 
 #include "frame.h"
 #include "energy.h"
 #include "diff.h"
+#include "storage.h"
+#include "region.h"
+#include "costmodel.h"
+#include "edmondskarp.h"
+#include "speculative.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -35,50 +44,335 @@ static const string default_ofilename = "frame_carved.pnm";
 static const string default_odebugfilename = "frame_seam.pnm";
 static const bool default_debug = false;
 static const size_t default_numcarves = 1;
+static const size_t default_memorycap = 0;
 
-void write_out(FrameWrapper& frame, string name) {
+template<typename T>
+void write_out(const T& frame, string name) {
   cout << "Writing to " << name << "\n";
   writePnm(frame, name);
   cout << "Done writing output.\n";
 }
 
-FrameWrapper* read_in(string name) {
+// energy is taken while loading, see readPnmDifferential
+bool read_in(string name, FrameWrapper& inputImage,
+             Frame<PixelValue>& energy) {
   cout << "Loading " << name << "\n";
-  FrameWrapper* inputImage = readPnm(name);
-  if (inputImage == NULL) {
+  if (!readPnmDifferential(name, inputImage, energy)) {
     cout << "Failed to load " << name << "\n";
-  } else {
-    cout << "Loaded " << name << " (" << inputImage->getHeight();
-    cout << "x" << inputImage->getWidth();
-    cout << " color:" << ((inputImage->color)?"true":"false") << ")" << "\n";
+    return false;
   }
-  return inputImage;
+  cout << "Loaded " << name << " (" << inputImage.getHeight();
+  cout << "x" << inputImage.getWidth();
+  cout << " color:" << ((inputImage.color)?"true":"false") << ")" << "\n";
+  return true;
 }
 
 void print_help() {
   cout << "\t-h\tPrint this help.\n";
   cout << "\t-o\tSpecify output filename (default: ";
-  cout << default_ofilename << ")\n";
-  cout << "\t-f\tSpecify input filename (default: ";
+  cout << default_ofilename << "; .qoi names are written as QOI)\n";
+  cout << "\t-f\tSpecify input filename, PNM or QOI (default: ";
   cout << default_ifilename << ")\n";
   cout << "\t-d\tEnable debug outut (default: ";
   cout << (default_debug?"true":"false") << ")\n";
   cout << "\t-g\tSpecify debug output filename (default: ";
   cout << default_odebugfilename << ")\n";
+  cout << "\t-s\tWrite the removed seams to this file\n";
   cout << "\t-c\tSpecify number of carves (default: ";
   cout << default_numcarves << ")\n";
+  cout << "\t-t\tSpecify target size WxH instead; columns are carved ";
+  cout << "first, then rows\n";
+  cout << "\t-m\tKeep at most this many MiB of large buffers in memory,\n";
+  cout << "\t\tthe rest are backed by files in $TMPDIR (default: ";
+  cout << "no limit)\n";
+  cout << "\t-p\tSpecify large buffer storage: heap, mapped, thp or ";
+  cout << "hugetlb (default: " << getStorageModeName(getStorageMode());
+  cout << ")\n";
+  cout << "\t-n\tPlace large buffers on the local NUMA node\n";
+  cout << "\t-l\tSpecify solver node layout: row, tiled or morton ";
+  cout << "(default: " << getNodeLayoutName(DEFAULT_NODE_LAYOUT) << ")\n";
+  cout << "\t-a\tSpecify max flow algorithm: ek, ibfs, region or auto ";
+  cout << "(default: " << getAlgorithmName(DEFAULT_ALGORITHM) << ")\n";
+  cout << "\t-j\tSpecify number of bands for the region algorithm ";
+  cout << "(default: one per core)\n";
+  cout << "\t--trace\tWrite a Chrome trace of each phase and carve to this ";
+  cout << "file\n";
+  cout << "\t--memory\tPrint the predicted and the actual peak memory\n";
+  cout << "\t--cost-model\tPick auto algorithms with this model, from ";
+  cout << "bench -m (default: " << DEFAULT_COST_MODEL << ", or ";
+  cout << getAlgorithmName(DEFAULT_ALGORITHM) << " if it is missing)\n";
+  cout << "\t--deadline\tGive each max flow this many ms, then cut the ";
+  cout << "cheapest path\n";
+  cout << "\t--scaling\tUse capacity scaling in the ek and region ";
+  cout << "algorithms\n";
+  cout << "\t--heatmap\tWrite the work the last max flow did per pixel to ";
+  cout << "this file\n";
+  cout << "\t--counter\tSpecify heatmap work: activated, orphaned, ";
+  cout << "adoptions or paths (default: ";
+  cout << getWorkCounterName(DEFAULT_WORK_COUNTER) << ")\n";
+  cout << "\t--cheapest\tWith -t, cut the cheaper of a column and a row ";
+  cout << "while both are left, solving both at once\n";
+  cout << "\t--replay\tRemove the seams in this file (see -s) instead of ";
+  cout << "carving\n";
   return;
 }
 
+void print_storage_stats() {
+  StorageStats stats = getStorageStats();
+  cout << "Storage (" << getStorageModeName(getStorageMode()) << "): peak ";
+  cout << (stats.peakHeapBytes >> 20) << " MiB heap, ";
+  cout << (stats.peakMappedBytes >> 20) << " MiB file backed (";
+  cout << stats.mappedBuffers << " buffers), ";
+  cout << (stats.peakHugeBytes >> 20) << " MiB huge pages (";
+  cout << stats.hugeBuffers << " buffers, " << stats.hugetlbBuffers;
+  cout << " hugetlb, " << stats.hugetlbFallbacks << " fallbacks)\n";
+  if (getStorageNumaLocal()) {
+    cout << "NUMA: " << stats.numaBuffers << " buffers bound to node ";
+    cout << stats.numaNode << "\n";
+  }
+}
+
+void print_memory(const Footprint& predicted) {
+  MemoryUsage usage = getMemoryUsage();
+  cout << "Memory peaks, predicted / actual (KiB):\n";
+  for (size_t i = 0; i < NUM_MEMORY_CATEGORIES; i++) {
+    cout << "\t" << getMemoryCategoryName((MemoryCategory)i) << ": ";
+    cout << (predicted.bytes[i] >> 10) << " / ";
+    cout << (usage.peakBytes[i] >> 10) << "\n";
+  }
+  cout << "\ttotal: " << (predicted.totalBytes >> 10) << " / ";
+  cout << (usage.peakTotalBytes >> 10) << "\n";
+}
+
+/* Carves current in place down to w x h and adds the removed seams to
+   seams. energy is the differential of current, and is deleted here.
+   Everything from the energy map on is instantiated per pixel type, so
+   there is no per-pixel color check. Unless heatmap is empty, the counter
+   of the last max flow is written there. With cheapest, columns and rows
+   are interleaved by cost instead. */
+template<typename T>
+void carve(Frame<T>& current, Frame<PixelValue>* energy, size_t w,
+           size_t h, NodeLayout layout, MaxFlowAlogorithm algorithm,
+           size_t regions, long budget, bool scaling, bool cheapest,
+           string heatmap, WorkCounter counter, SeamSet& seams) {
+  if (algorithm == AUTOMATIC) {
+    double predicted;
+    algorithm = resolveAlgorithm(algorithm, *energy, &predicted);
+    cout << "Picked " << getAlgorithmName(algorithm) << " (predicted ";
+    cout << (size_t)(predicted / 1000) << " ms per carve)\n";
+  }
+  FlowState* state;
+  SpeculativeFlowState* speculative = NULL;
+  if (cheapest) {
+    state = speculative = new SpeculativeFlowState(energy, algorithm);
+  } else {
+    state = getNewFlowState(energy, algorithm);
+  }
+  state->layout = layout;
+  // the settings go to the state of each direction
+  for (size_t i = 0; i < (speculative != NULL ? 2 : 1); i++) {
+    FlowState* solver = (speculative != NULL) ?
+      &speculative->getState((FlowDirection)i) : state;
+    RegionFlowState* region = dynamic_cast<RegionFlowState*>(solver);
+    if (region != NULL) {
+      region->regions = regions;
+    }
+    EdmondsKarpFlowState* ek = dynamic_cast<EdmondsKarpFlowState*>(solver);
+    if (ek != NULL) {
+      ek->scaling = scaling;
+    }
+  }
+  state->countWork = !heatmap.empty();
+
+  // seams left to cut, by FlowDirection
+  size_t left[2] = { current.w - w, current.h - h };
+  size_t carves = left[FLOW_LEFT_RIGHT] + left[FLOW_TOP_BOTTOM];
+  /* Unless interleaved, rows are cut as the columns of the transposed
+     frame, so that both walk the solver nodes and the frames row by
+     row */
+  Frame<T> transposed;
+  Frame<T>* subject = &current;
+  for (size_t i = 0; i < carves; i++) {
+    TraceScope trace("carve", "seam", i);
+    if (speculative == NULL && left[FLOW_LEFT_RIGHT] == 0 &&
+        subject != &transposed) {
+      cout << "Transposing frame for " << left[FLOW_TOP_BOTTOM];
+      cout << " rows...\n";
+      transposeFrame(current, transposed);
+      Frame<PixelValue>* energy = new Frame<PixelValue>;
+      transposeFrame(*state->energy, *energy);
+      delete state->energy;
+      state->energy = energy;
+      subject = &transposed;
+    }
+    cout << "Calculating best flow...\n";
+    if (budget > 0) {
+      state->deadline = FlowState::Clock::now() +
+                        chrono::milliseconds(budget);
+    }
+    FlowState::EnergyType t;
+    FlowDirection direction = (left[FLOW_LEFT_RIGHT] > 0) ? FLOW_LEFT_RIGHT
+                                                         : FLOW_TOP_BOTTOM;
+    {
+      TraceScope flow("calcMaxFlow");
+      if (speculative != NULL && left[FLOW_LEFT_RIGHT] > 0 &&
+          left[FLOW_TOP_BOTTOM] > 0) {
+        direction = speculative->calcCheaperFlow();
+        t = state->s.flow;
+        cout << "Cheaper seam is a " << ((direction == FLOW_LEFT_RIGHT) ?
+                                         "column" : "row") << "\n";
+      } else {
+        t = state->calcMaxFlow((subject == &transposed) ? FLOW_LEFT_RIGHT
+                                                        : direction);
+      }
+      flow.addArg("flow", t);
+    }
+    left[direction]--;
+    cout << "Done calculating best flow (" << state->energy->w * state->energy->h;
+    cout << " nodes, flow: " << t;
+    if (state->approximate) cout << ", out of time";
+    cout << ")!\n";
+    const FlowState& solved = (speculative != NULL) ?
+                              speculative->getSolved() : *state;
+    const EdmondsKarpFlowState* ek =
+      dynamic_cast<const EdmondsKarpFlowState*>(&solved);
+    if (ek != NULL && scaling) {
+      cout << "Augmenting paths per phase:";
+      for (size_t j = 0; j < ek->phasePaths.size(); j++) {
+        cout << " " << ek->phasePaths[j];
+      }
+      cout << "\n";
+    }
+    if (!heatmap.empty() && i + 1 == carves) {
+      Frame<RgbPixel>* work = getWorkHeatmap(solved, counter);
+      if (work != NULL && subject == &transposed) {
+        Frame<RgbPixel> back;
+        transposeFrame(*work, back);
+        write_out(back, heatmap);
+        delete work;
+      } else if (work != NULL) {
+        write_out(*work, heatmap);
+        delete work;
+      } else {
+        cout << "No work was counted for " << heatmap << "\n";
+      }
+    }
+
+    cout << "Cutting frame...\n";
+    seams.push_back(Seam());
+    state->cutFrame(*subject, &seams.back());
+    if (subject == &transposed) {
+      // a column of the transposed frame is a row of current
+      seams.back().direction = FLOW_TOP_BOTTOM;
+    }
+    if (seams.back().approximate) {
+      cout << "Cut the cheapest path instead (energy: ";
+      cout << seams.back().cost << ")\n";
+    }
+    cout << "Done cutting frame...\n";
+  }
+  if (subject == &transposed) {
+    transposeFrame(transposed, current);
+  }
+
+  delete state;
+}
+
+// Removes seams from current without solving
+template<typename T>
+bool replay(Frame<T>& current, const SeamSet& seams) {
+  for (SeamSet::const_iterator i = seams.begin(); i != seams.end(); ++i) {
+    if (!fitsFrame(*i, current.w, current.h)) {
+      cout << "Seam " << (i - seams.begin()) << " does not fit the ";
+      cout << current.w << "x" << current.h << " frame\n";
+      return false;
+    }
+    removeSeam(current, *i);
+  }
+  return true;
+}
+
+// current is what is left after seam was removed
+template<typename T>
+void write_debug(const Frame<T>& current, const Seam& seam, string name) {
+  Frame<T> mask(current.w + (seam.direction == FLOW_LEFT_RIGHT ? 1 : 0),
+                current.h + (seam.direction == FLOW_TOP_BOTTOM ? 1 : 0));
+  drawSeam(seam, mask);
+  write_out(mask, name);
+}
+
+bool read_cost_model(string name) {
+  fstream ifile(name.c_str(), fstream::in);
+  CostModel model;
+  if (!ifile.is_open() || !loadCostModel(ifile, model) ||
+      model.coefficients.empty()) {
+    cout << "Failed to load cost model " << name << "\n";
+    return false;
+  }
+  setCostModel(model);
+  return true;
+}
+
+bool read_seams(string name, SeamSet& seams) {
+  cout << "Loading seams from " << name << "\n";
+  fstream ifile(name.c_str(), fstream::in);
+  if (!ifile.is_open() || !loadSeams(ifile, seams)) {
+    cout << "Failed to load seams from " << name << "\n";
+    return false;
+  }
+  cout << "Loaded " << seams.size() << " seams\n";
+  return true;
+}
+
+void write_seams(const SeamSet& seams, string name) {
+  cout << "Writing seams to " << name << "\n";
+  fstream ofile(name.c_str(), fstream::out);
+  printSeams(seams, ofile);
+  ofile.close();
+}
+
 int main(int argc, char** argv) {
   string ifilename = default_ifilename;
   string ofilename = default_ofilename;
   string odebugfilename = default_odebugfilename;
   bool debug = default_debug;
   size_t carves = default_numcarves;
+  // 0 for the input size less carves columns
+  size_t targetw = 0, targeth = 0;
+  size_t memorycap = default_memorycap;
   int c;
 
-  while ((c = getopt(argc, argv, "f:o:dg:c:h")) != -1) {
+  StorageMode storage;
+  NodeLayout layout = DEFAULT_NODE_LAYOUT;
+  MaxFlowAlogorithm algorithm = DEFAULT_ALGORITHM;
+  size_t regions = 0;
+  string tracefilename;
+  bool memory = false;
+  string seamsfilename;
+  string replayfilename;
+  string costmodelfilename = DEFAULT_COST_MODEL;
+  bool costmodelgiven = false;
+  long budget = 0;
+  bool scaling = false;
+  bool cheapest = false;
+  string heatmapfilename;
+  WorkCounter counter = DEFAULT_WORK_COUNTER;
+
+  static const struct option longopts[] = {
+    { "trace", required_argument, NULL, 'T' },
+    { "memory", no_argument, NULL, 'M' },
+    { "replay", required_argument, NULL, 'R' },
+    { "cost-model", required_argument, NULL, 'C' },
+    { "deadline", required_argument, NULL, 'D' },
+    { "scaling", no_argument, NULL, 'S' },
+    { "cheapest", no_argument, NULL, 'B' },
+    { "heatmap", required_argument, NULL, 'H' },
+    { "counter", required_argument, NULL, 'W' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((c = getopt_long(argc, argv, "f:o:dg:s:c:t:m:p:nl:a:j:h", longopts,
+                          NULL)) != -1) {
     switch (c) {
     case 'h':
       print_help();
@@ -95,54 +389,167 @@ int main(int argc, char** argv) {
     case 'g':
       odebugfilename = optarg;
       break;
+    case 's':
+      seamsfilename = optarg;
+      break;
     case 'c':
       carves = atoi(optarg);
       break;
+    case 't':
+      if (sscanf(optarg, "%zux%zu", &targetw, &targeth) != 2 ||
+          targetw == 0 || targeth == 0) {
+        cout << "Bad target size " << optarg << "\n";
+        return 1;
+      }
+      break;
+    case 'm':
+      memorycap = strtoul(optarg, NULL, 10) << 20;
+      setStorageMode(STORAGE_MAPPED);
+      setStorageMemoryCap(memorycap);
+      break;
+    case 'p':
+      if (!parseStorageMode(optarg, storage)) {
+        cout << "Unknown storage " << optarg << "\n";
+        return 1;
+      }
+      setStorageMode(storage);
+      break;
+    case 'n':
+      setStorageNumaLocal(true);
+      break;
+    case 'l':
+      if (!parseNodeLayout(optarg, layout)) {
+        cout << "Unknown layout " << optarg << "\n";
+        return 1;
+      }
+      break;
+    case 'a':
+      if (!parseAlgorithm(optarg, algorithm)) {
+        cout << "Unknown algorithm " << optarg << "\n";
+        return 1;
+      }
+      break;
+    case 'j':
+      regions = atoi(optarg);
+      break;
+    case 'T':
+      tracefilename = optarg;
+      break;
+    case 'M':
+      memory = true;
+      setMemoryCounting(true);
+      break;
+    case 'R':
+      replayfilename = optarg;
+      break;
+    case 'C':
+      costmodelfilename = optarg;
+      costmodelgiven = true;
+      break;
+    case 'D':
+      budget = atol(optarg);
+      break;
+    case 'S':
+      scaling = true;
+      break;
+    case 'B':
+      cheapest = true;
+      break;
+    case 'H':
+      heatmapfilename = optarg;
+      break;
+    case 'W':
+      if (!parseWorkCounter(optarg, counter)) {
+        cout << "Unknown counter " << optarg << "\n";
+        return 1;
+      }
+      break;
     default:
       return 1;
       break;
     }
   }
 
-  FrameWrapper* inputImage = NULL;
-  FrameWrapper* current = NULL;
-  FrameWrapper* cut = NULL;
+  if (!tracefilename.empty()) {
+    startTrace();
+  }
 
-  inputImage = read_in(ifilename);
+  if (algorithm == AUTOMATIC) {
+    fstream ifile(costmodelfilename.c_str(), fstream::in);
+    // only a model named with --cost-model has to be there
+    if (!costmodelgiven && !ifile.is_open()) {
+      cout << "Warning: no cost model " << costmodelfilename << ", using ";
+      cout << getAlgorithmName(DEFAULT_ALGORITHM) << "\n";
+      algorithm = DEFAULT_ALGORITHM;
+    } else if (!read_cost_model(costmodelfilename)) {
+      return 1;
+    }
+  }
 
-  if (inputImage == NULL) return 1;
+  FrameWrapper inputImage;
+  Frame<PixelValue> energy;
+  if (!read_in(ifilename, inputImage, energy)) return 1;
 
-  current = inputImage;
+  if (targetw == 0) {
+    targetw = (carves < inputImage.getWidth()) ?
+              inputImage.getWidth() - carves : 1;
+    targeth = inputImage.getHeight();
+  }
+  if (targetw > inputImage.getWidth() || targeth > inputImage.getHeight()) {
+    cout << "Cannot carve to " << targetw << "x" << targeth << "\n";
+    return 1;
+  }
 
-  FlowState* state = getNewFlowState(*current);
+  Footprint predicted = predictFootprint(inputImage.getWidth(),
+                                         inputImage.getHeight(),
+                                         inputImage.color, algorithm,
+                                         layout);
 
-  for (size_t i = 0; i < carves; i++) {
-    cout << "Calculating best flow...\n";
-    FlowState::EnergyType t = state->calcMaxFlow(FLOW_LEFT_RIGHT);
-    cout << "Done calculating best flow (" << state->energy->w * state->energy->h;
-    cout << " nodes, flow: " << t << ")!\n";
+  SeamSet seams;
+  if (!replayfilename.empty()) {
+    bool ok = read_seams(replayfilename, seams) &&
+              (inputImage.color ? replay(inputImage.colorFrame, seams)
+                                : replay(inputImage.greyFrame, seams));
+    if (!ok) return 1;
+  } else if (inputImage.color) {
+    carve(inputImage.colorFrame, new Frame<PixelValue>(move(energy)),
+          targetw, targeth, layout, algorithm, regions, budget, scaling,
+          cheapest, heatmapfilename, counter, seams);
+  } else {
+    carve(inputImage.greyFrame, new Frame<PixelValue>(move(energy)),
+          targetw, targeth, layout, algorithm, regions, budget, scaling,
+          cheapest, heatmapfilename, counter, seams);
+  }
 
-    cout << "Cutting frame...\n";
-    if (debug) {
-      cut = new FrameWrapper(current->color);
-      cut->setSize(current->getWidth(), current->getHeight());
+  if (debug && !seams.empty()) {
+    if (inputImage.color) {
+      write_debug(inputImage.colorFrame, seams.back(), odebugfilename);
     } else {
-      cut = NULL;
+      write_debug(inputImage.greyFrame, seams.back(), odebugfilename);
     }
-    FrameWrapper* result = state->cutFrame(*current, cut);
-    delete current;
-    current = result;
-    cout << "Done cutting frame...\n";
   }
 
-  if (debug) {
-    write_out(*cut, odebugfilename);
+  if (!seamsfilename.empty()) {
+    write_seams(seams, seamsfilename);
   }
 
-  write_out(*current, ofilename);
+  write_out(inputImage, ofilename);
+
+  if (!tracefilename.empty()) {
+    if (writeTrace(tracefilename)) {
+      cout << "Wrote trace to " << tracefilename << "\n";
+    } else {
+      cout << "Could not write trace to " << tracefilename << "\n";
+    }
+  }
+
+  if (getStorageMode() != STORAGE_HEAP || getStorageNumaLocal()) {
+    print_storage_stats();
+  }
+
+  if (memory) {
+    print_memory(predicted);
+  }
 
-  delete state;
-  delete current;
-  delete cut;
   return 0;
 }
@@ -0,0 +1,131 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include "trace.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+struct TraceEvent {
+  const char* name;
+  int thread;
+  TraceScope::Clock::duration start;
+  TraceScope::Clock::duration length;
+  size_t numArgs;
+  const char* keys[TraceScope::MAX_ARGS];
+  long values[TraceScope::MAX_ARGS];
+};
+
+static atomic<bool> tracing(false);
+static mutex traceMutex;
+static TraceScope::Clock::time_point origin;
+static vector<TraceEvent> events;
+static atomic<int> numThreads(0);
+
+// Small per thread number, in the order threads first record something
+static int getThread() {
+  static thread_local int id = numThreads++;
+  return id;
+}
+
+void startTrace() {
+  lock_guard<mutex> lock(traceMutex);
+  events.clear();
+  origin = TraceScope::Clock::now();
+  tracing = true;
+}
+
+bool isTracing() {
+  return tracing;
+}
+
+static double toMicros(TraceScope::Clock::duration d) {
+  return chrono::duration_cast<chrono::nanoseconds>(d).count() / 1000.0;
+}
+
+bool writeTrace(const string& filename) {
+  tracing = false;
+  lock_guard<mutex> lock(traceMutex);
+  ofstream out(filename.c_str());
+  if (!out) return false;
+  out << "{\"traceEvents\":[\n";
+  out.setf(ios::fixed);
+  out.precision(3);
+  for (size_t i = 0; i < events.size(); i++) {
+    const TraceEvent& e = events[i];
+    out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,";
+    out << "\"tid\":" << e.thread << ",\"ts\":" << toMicros(e.start);
+    out << ",\"dur\":" << toMicros(e.length);
+    if (e.numArgs > 0) {
+      out << ",\"args\":{";
+      for (size_t j = 0; j < e.numArgs; j++) {
+        out << (j ? "," : "") << "\"" << e.keys[j] << "\":" << e.values[j];
+      }
+      out << "}";
+    }
+    out << "}" << (i + 1 < events.size() ? ",\n" : "\n");
+  }
+  out << "],\"displayTimeUnit\":\"ms\"}\n";
+  events.clear();
+  return out.good();
+}
+
+TraceScope::TraceScope(const char* name) : name(name), active(tracing),
+  numArgs(0) {
+  if (active) start = Clock::now();
+}
+
+TraceScope::TraceScope(const char* name, const char* key, long value) :
+  name(name), active(tracing), numArgs(0) {
+  addArg(key, value);
+  if (active) start = Clock::now();
+}
+
+TraceScope::~TraceScope() {
+  if (!active) return;
+  Clock::time_point end = Clock::now();
+  TraceEvent e;
+  e.name = name;
+  e.thread = getThread();
+  e.length = end - start;
+  e.numArgs = numArgs;
+  for (size_t i = 0; i < numArgs; i++) {
+    e.keys[i] = keys[i];
+    e.values[i] = values[i];
+  }
+  lock_guard<mutex> lock(traceMutex);
+  // tracing may have been restarted while this scope was open
+  if (!tracing || start < origin) return;
+  e.start = start - origin;
+  events.push_back(e);
+}
+
+void TraceScope::addArg(const char* key, long value) {
+  if (numArgs < MAX_ARGS) {
+    keys[numArgs] = key;
+    values[numArgs] = value;
+    numArgs++;
+  }
+}
@@ -0,0 +1,87 @@
+/* Copyright (C) 2012 Allan Wirth <allan@allanwirth.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// Events are recorded from startTrace until writeTrace
+void startTrace();
+bool isTracing();
+/* Writes the events as Chrome trace-event JSON, for chrome://tracing or
+   Perfetto, and stops tracing. Returns false if the file can't be
+   written. */
+bool writeTrace(const std::string& filename);
+
+/* Records one event spanning its own lifetime, on the calling thread.
+   name must be a literal. When not tracing it costs one flag check. */
+class TraceScope {
+public:
+  typedef std::chrono::steady_clock Clock;
+  static const std::size_t MAX_ARGS = 4;
+
+  explicit TraceScope(const char* name);
+  // with one argument, e.g. the carve number
+  TraceScope(const char* name, const char* key, long value);
+  ~TraceScope();
+
+  // shown with the event; key must be a literal
+  void addArg(const char* key, long value);
+
+private:
+  TraceScope(const TraceScope&);
+  TraceScope& operator=(const TraceScope&);
+
+  const char* name;
+  bool active;
+  Clock::time_point start;
+  std::size_t numArgs;
+  const char* keys[MAX_ARGS];
+  long values[MAX_ARGS];
+};
+
+/* Adds up many short intervals inside one TraceScope, such as the steps
+   of the max flow loop, which are too many to record one by one. */
+class TraceCounter {
+public:
+  TraceCounter() : active(isTracing()), total(0) { }
+
+  void start() {
+    if (active) begin = TraceScope::Clock::now();
+  }
+  void stop() {
+    if (active) total += TraceScope::Clock::now() - begin;
+  }
+  long micros() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(total)
+      .count();
+  }
+
+private:
+  bool active;
+  TraceScope::Clock::time_point begin;
+  TraceScope::Clock::duration total;
+};
+
+#endif